@@ -10,7 +10,20 @@
 
 #include <inttypes.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include "clock.h"
+#include "usbasp.h"
+
+#if USBASP_WITH_STATS
+clock_stats_t clock_stats;
+#endif
+
+static volatile uint32_t clock_overflows;
+
+/* must not delay the USB interrupt */
+ISR(TIMER0_OVF_vect, ISR_NOBLOCK) {
+	clock_overflows++;
+}
 
 /* wait time * 320 us */
 void clockWait(uint8_t time) {
@@ -21,4 +34,28 @@ void clockWait(uint8_t time) {
 		while ((uint8_t) (TIMERVALUE - starttime) < CLOCK_T_320us) {
 		}
 	}
+
+#if USBASP_WITH_STATS
+	clock_stats.wait += (uint16_t) time * CLOCK_T_320us;
+#endif
+}
+
+unsigned long clockTicks() {
+
+	uint32_t high;
+	uint8_t low, pending;
+
+	/* consistent snapshot, the interrupt may run in between */
+	do {
+		high = clock_overflows;
+		low = TIMERVALUE;
+		pending = TIFR0 & (1 << TOV0);
+	} while (high != clock_overflows);
+
+	/* timer wrapped, but the interrupt didn't run yet */
+	if (pending && (low < 128))
+		high++;
+
+	/* low 32 bits of the 40 bit count */
+	return (high << 8) | low;
 }
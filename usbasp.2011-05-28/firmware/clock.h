@@ -17,12 +17,30 @@
 
 #ifdef __AVR_ATmega8__
 #define TCCR0B  TCCR0
+#define TIFR0   TIFR
+#define TIFR1   TIFR
+#define TIMSK0  TIMSK
 #endif
 
-/* set prescaler to 64 */
-#define clockInit()  TCCR0B = (1 << CS01) | (1 << CS00);
+/* set prescaler to 64, overflow interrupt extends the timer for
+   clockTicks() */
+#define clockInit()  TCCR0B = (1 << CS01) | (1 << CS00); TIMSK0 = (1 << TOIE0);
+
+/* timing statistics in clock ticks (64 / F_CPU), read with GETSTATS */
+typedef struct {
+	unsigned long spi;      /* SPI block transfers */
+	unsigned long flush;    /* waiting for target writes to finish */
+	unsigned long wait;     /* clockWait() */
+	unsigned long polls;    /* data or RDY/BSY polls finding target busy */
+	unsigned long packets;  /* USB setup and data packets */
+} clock_stats_t;
+
+extern clock_stats_t clock_stats;
 
 /* wait time * 320 us */
 void clockWait(uint8_t time);
 
+/* timer 0 ticks since start, wraps after about 6.4 hours at 12 MHz */
+unsigned long clockTicks();
+
 #endif /* __clock_h_included__ */
@@ -0,0 +1,25 @@
+/*
+ * avr/eeprom.h - part of USBasp host side emulator
+ *
+ * Description....: Programmer EEPROM, addresses are EEPROM offsets
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#ifndef __emu_avr_eeprom_h_included__
+#define	__emu_avr_eeprom_h_included__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EEMEM
+
+uint8_t eeprom_read_byte(const uint8_t *addr);
+uint16_t eeprom_read_word(const uint16_t *addr);
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_update_byte(uint8_t *addr, uint8_t value);
+void eeprom_update_word(uint16_t *addr, uint16_t value);
+void eeprom_update_block(const void *src, void *dst, size_t n);
+
+#endif /* __emu_avr_eeprom_h_included__ */
@@ -0,0 +1,22 @@
+/*
+ * avr/interrupt.h - part of USBasp host side emulator
+ *
+ * Description....: Interrupt handlers become plain functions, the emulator
+ *                  calls them when simulated time passes
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#ifndef __emu_avr_interrupt_h_included__
+#define	__emu_avr_interrupt_h_included__
+
+#define sei()
+#define cli()
+
+#define ISR_NOBLOCK
+#define ISR(vector, ...)  void vector(void)
+
+void TIMER0_OVF_vect(void);
+
+#endif /* __emu_avr_interrupt_h_included__ */
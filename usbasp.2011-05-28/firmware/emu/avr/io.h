@@ -0,0 +1,79 @@
+/*
+ * avr/io.h - part of USBasp host side emulator
+ *
+ * Description....: ATmega8 registers used by the firmware. ISP port, SPI
+ *                  and timer registers are cells returned by emu_reg(), so
+ *                  the emulator sees every access and advances time
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#ifndef __emu_avr_io_h_included__
+#define	__emu_avr_io_h_included__
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+volatile uint32_t *emu_reg(uint8_t reg);
+
+#define PORTB   (*emu_reg(0))
+#define DDRB    (*emu_reg(1))
+#define PINB    (*emu_reg(2))
+#define SPDR    (*emu_reg(3))
+#define SPSR    (*emu_reg(4))
+#define TCNT0   (*emu_reg(5))
+#define TCNT1   (*emu_reg(6))
+#define TIFR    (*emu_reg(7))
+
+/* registers without side effects */
+extern volatile uint8_t PORTC, DDRC, PINC, PORTD, DDRD, PIND;
+extern volatile uint8_t SPCR, TCCR0, TCCR1A, TCCR1B, TIMSK, GICR, MCUCR;
+extern volatile uint16_t OCR1A;
+
+#define PB0     0
+#define PB1     1
+#define PB2     2
+#define PB3     3
+#define PB4     4
+#define PB5     5
+#define PC0     0
+#define PC1     1
+#define PC2     2
+
+#define SPIE    7
+#define SPE     6
+#define MSTR    4
+#define SPR1    1
+#define SPR0    0
+#define SPIF    7
+#define WCOL    6
+#define SPI2X   0
+
+#define CS02    2
+#define CS01    1
+#define CS00    0
+#define WGM12   3
+#define CS12    2
+#define CS11    1
+#define CS10    0
+#define OCF1A   4
+#define TOV0    0
+#define TOIE0   0
+
+#define INT0    6
+#define ISC01   1
+#define ISC00   0
+
+/* ATmega8, DEFINES="-DFLASHEND=0xFFF -DRAMEND=0x2FF" builds an ATmega48
+   image */
+#ifndef FLASHEND
+#define FLASHEND 0x1FFF
+#endif
+#ifndef RAMEND
+#define RAMEND  0x45F
+#endif
+#define E2END   0x1FF
+
+#endif /* __emu_avr_io_h_included__ */
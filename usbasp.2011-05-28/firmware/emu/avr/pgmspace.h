@@ -0,0 +1,20 @@
+/*
+ * avr/pgmspace.h - part of USBasp host side emulator
+ *
+ * Description....: Flash data is ordinary memory on the host
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#ifndef __emu_avr_pgmspace_h_included__
+#define	__emu_avr_pgmspace_h_included__
+
+#include <stdint.h>
+
+#define PROGMEM
+#define PSTR(s)              (s)
+#define pgm_read_byte(addr)  (*(const uint8_t *) (addr))
+#define pgm_read_word(addr)  (*(const uint16_t *) (addr))
+
+#endif /* __emu_avr_pgmspace_h_included__ */
@@ -0,0 +1,16 @@
+/*
+ * avr/wdt.h - part of USBasp host side emulator
+ *
+ * Description....: The watchdog isn't used by the firmware
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#ifndef __emu_avr_wdt_h_included__
+#define	__emu_avr_wdt_h_included__
+
+#define wdt_reset()
+#define wdt_disable()
+
+#endif /* __emu_avr_wdt_h_included__ */
@@ -0,0 +1,298 @@
+/*
+ * emu.c - part of USBasp
+ *
+ * Description....: Host side emulator: simulated time and the registers
+ *                  the firmware uses for ISP, SPI and timing
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include "emu.h"
+#include "isp.h"
+
+/* a cell holds the value the firmware reads, marked with EMU_MARK. the
+   next access finds the cell changed if the firmware wrote to it */
+#define EMU_MARK  0x80000000UL
+
+unsigned long long emu_cycles;
+emu_stats_t emu_stats;
+
+volatile uint8_t PORTC, DDRC, PINC, PORTD, DDRD, PIND;
+volatile uint8_t SPCR, TCCR0, TCCR1A, TCCR1B, TIMSK, GICR, MCUCR;
+volatile uint16_t OCR1A;
+
+static volatile uint32_t emu_cell[EMU_REGS];
+static uint32_t emu_shown[EMU_REGS];
+
+static uchar emu_portb;
+static uchar emu_ddrb;
+
+/* hardware SPI */
+static uchar spi_active;
+static uchar spi_flag;
+static uchar spi_2x;
+static uchar spi_data;
+static uchar spi_next;
+static unsigned long long spi_done;
+
+/* timer 0 (clock.c) */
+static unsigned int t0_prescaler;
+static unsigned long long t0_base;
+static unsigned long long t0_overflows;
+static uchar t0_inisr;
+
+/* timer 1 (software SCK) */
+static unsigned long long t1_base;
+static unsigned long long t1_matches;
+static uchar t1_flag;
+
+static unsigned long long emu_lastpoll;
+
+/* programmer EEPROM */
+static uchar emu_eeprom[E2END + 1];
+
+uint8_t eeprom_read_byte(const uint8_t *addr) {
+	return emu_eeprom[(uintptr_t) addr % sizeof(emu_eeprom)];
+}
+
+uint16_t eeprom_read_word(const uint16_t *addr) {
+	return eeprom_read_byte((const uint8_t *) addr)
+			| (eeprom_read_byte((const uint8_t *) addr + 1) << 8);
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		((uint8_t *) dst)[i] = eeprom_read_byte((const uint8_t *) src + i);
+	}
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t value) {
+	emu_eeprom[(uintptr_t) addr % sizeof(emu_eeprom)] = value;
+}
+
+void eeprom_update_word(uint16_t *addr, uint16_t value) {
+	eeprom_update_byte((uint8_t *) addr, value);
+	eeprom_update_byte((uint8_t *) addr + 1, value >> 8);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		eeprom_update_byte((uint8_t *) dst + i, ((const uint8_t *) src)[i]);
+	}
+}
+
+/* SCK half period of the hardware SPI in CPU cycles */
+static unsigned long spiHalfPeriod() {
+	static const uchar divider[4] = { 4, 16, 64, 128 };
+	unsigned long n;
+
+	n = divider[SPCR & ((1 << SPR1) | (1 << SPR0))];
+	if (spi_2x)
+		n /= 2;
+
+	return n / 2;
+}
+
+static void spiWrite(uchar value) {
+	unsigned long halfperiod;
+
+	if (!(SPCR & (1 << SPE)))
+		return;
+
+	if (spi_active) {
+		/* write collision, the running transfer continues */
+		emu_stats.collisions++;
+		return;
+	}
+
+	halfperiod = spiHalfPeriod();
+	spi_next = target_exchange(value, halfperiod);
+	spi_done = emu_cycles + 16 * halfperiod;
+	spi_active = 1;
+	spi_flag = 0;
+	emu_stats.spi++;
+}
+
+/* pins seen by the target: outputs, RST has a pull-up. MOSI is TPIDATA
+   too, an input with the pull-up on reads high */
+static void portUpdate() {
+	uchar out = emu_portb & emu_ddrb;
+	uchar rst = (emu_ddrb & (1 << ISP_RST)) ? (out & (1 << ISP_RST)) : 1;
+
+	if (SPCR & (1 << SPE)) {
+		/* SCK and MOSI belong to the SPI, idle low */
+		target_pins(rst != 0, 0, 0);
+	} else {
+		target_pins(rst != 0, (out & (1 << ISP_SCK)) != 0, (emu_portb
+				& (1 << ISP_MOSI)) != 0);
+	}
+}
+
+static unsigned long long timer1Matches() {
+	unsigned long long period = (unsigned long long) OCR1A + 1;
+
+	if (!(TCCR1B & ((1 << CS12) | (1 << CS11) | (1 << CS10))))
+		return t1_matches;
+
+	return (emu_cycles - t1_base) / period;
+}
+
+static void regWrite(uchar reg, uint32_t value) {
+
+	switch (reg) {
+	case EMU_PORTB:
+		emu_portb = value;
+		portUpdate();
+		break;
+	case EMU_DDRB:
+		emu_ddrb = value;
+		portUpdate();
+		break;
+	case EMU_SPDR:
+		spiWrite(value);
+		break;
+	case EMU_SPSR:
+		spi_2x = value & (1 << SPI2X);
+		break;
+	case EMU_TCNT1:
+		t1_base = emu_cycles - (value & 0xFFFF);
+		t1_matches = 0;
+		break;
+	case EMU_TIFR:
+		if (value & (1 << OCF1A)) {
+			t1_matches = timer1Matches();
+			t1_flag = 0;
+		}
+		break;
+	}
+}
+
+static uint32_t regRead(uchar reg) {
+	unsigned long long n;
+
+	switch (reg) {
+	case EMU_PORTB:
+		return emu_portb;
+	case EMU_DDRB:
+		return emu_ddrb;
+	case EMU_PINB:
+		/* the target pulls TPIDATA low */
+		return (emu_portb & ~((1 << ISP_MISO) | (!target_data() << ISP_MOSI)))
+				| (target_miso() << ISP_MISO);
+	case EMU_SPDR:
+		/* access clears SPIF */
+		spi_flag = 0;
+		return spi_data;
+	case EMU_SPSR:
+		return (spi_flag << SPIF) | spi_2x;
+	case EMU_TCNT0:
+		return t0_prescaler ? ((emu_cycles - t0_base) / t0_prescaler) & 0xFF
+				: 0;
+	case EMU_TCNT1:
+		n = (unsigned long long) OCR1A + 1;
+		return (emu_cycles - t1_base) % n;
+	case EMU_TIFR:
+		n = timer1Matches();
+		if (n != t1_matches) {
+			t1_matches = n;
+			t1_flag = 1;
+		}
+		return t1_flag << OCF1A;
+	}
+
+	return 0;
+}
+
+void emu_sync(void) {
+	uchar reg;
+
+	for (reg = 0; reg < EMU_REGS; reg++) {
+		if (emu_cell[reg] != emu_shown[reg]) {
+			emu_shown[reg] = emu_cell[reg];
+			regWrite(reg, emu_cell[reg] & ~EMU_MARK);
+		}
+	}
+}
+
+volatile uint32_t *emu_reg(uint8_t reg) {
+
+	emu_sync();
+	emu_advance(EMU_ACCESS_CYCLES);
+
+	emu_shown[reg] = regRead(reg) | EMU_MARK;
+	emu_cell[reg] = emu_shown[reg];
+
+	return &emu_cell[reg];
+}
+
+void emu_advance(unsigned long cycles) {
+	static const unsigned int prescaler[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	unsigned int p;
+	unsigned long long n;
+
+	emu_cycles += cycles;
+	emu_stats.cycles += cycles;
+
+	if (spi_active && (emu_cycles >= spi_done)) {
+		spi_active = 0;
+		spi_data = spi_next;
+		spi_flag = 1;
+	}
+
+	/* timer 0 restarts counting if the prescaler changes */
+	p = prescaler[TCCR0 & 7];
+	if (p != t0_prescaler) {
+		t0_prescaler = p;
+		t0_base = emu_cycles;
+		t0_overflows = 0;
+	}
+
+	if (p && !t0_inisr) {
+		n = (emu_cycles - t0_base) / (256UL * p);
+		t0_inisr = 1;
+		while (t0_overflows < n) {
+			t0_overflows++;
+			if (TIMSK & (1 << TOIE0))
+				TIMER0_OVF_vect();
+		}
+		t0_inisr = 0;
+	}
+
+	if (emu_cycles - emu_lastpoll > EMU_STUCK_CYCLES) {
+		fprintf(stderr, "emu: firmware stuck, no usbPoll() for %llu ms\n",
+				(emu_cycles - emu_lastpoll) / EMU_CYCLES_US(1000));
+		exit(2);
+	}
+}
+
+void emu_polled(void) {
+	emu_lastpoll = emu_cycles;
+}
+
+void emu_init(void) {
+	uchar reg;
+
+	memset(emu_eeprom, 0xFF, sizeof(emu_eeprom));
+	for (reg = 0; reg < EMU_REGS; reg++) {
+		emu_shown[reg] = EMU_MARK;
+		emu_cell[reg] = EMU_MARK;
+	}
+
+	/* jumper J3 open: SCK is set by software */
+	PINC = 0xFF;
+
+	target_init();
+	portUpdate();
+}
@@ -0,0 +1,111 @@
+/*
+ * emu.h - part of USBasp
+ *
+ * Description....: Host side emulator: simulated time, register layer and
+ *                  target model interface
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#ifndef __emu_h_included__
+#define	__emu_h_included__
+
+#ifndef uchar
+#define	uchar	unsigned char
+#endif
+
+#define EMU_F_CPU          12000000UL
+#define EMU_CYCLES_US(us)  ((unsigned long long) (us) * (EMU_F_CPU / 1000000))
+
+/* cost of one register access and of one main loop turn. code between
+   register accesses is free, so CPU time is a lower bound while SPI,
+   timer and target timing are exact */
+#define EMU_ACCESS_CYCLES  2
+#define EMU_LOOP_CYCLES    40
+
+/* firmware hangs if usbPoll() isn't called for this long */
+#define EMU_STUCK_CYCLES   EMU_CYCLES_US(2000000)
+
+/* registers accessed through emu_reg() */
+#define EMU_PORTB   0
+#define EMU_DDRB    1
+#define EMU_PINB    2
+#define EMU_SPDR    3
+#define EMU_SPSR    4
+#define EMU_TCNT0   5
+#define EMU_TCNT1   6
+#define EMU_TIFR    7
+#define EMU_REGS    8
+
+/* counters of one emulated operation */
+typedef struct {
+	unsigned long long cycles;
+	unsigned long spi;          /* SPI bytes exchanged with the target */
+	unsigned long usb;          /* USB transactions */
+	unsigned long naks;         /* transactions the device NAKed */
+	unsigned long writes;       /* flash pages, EEPROM bytes/pages, fuses */
+	unsigned long polls;        /* RDY/BSY polls */
+	unsigned long violations;   /* instructions sent while target was busy */
+	unsigned long corrupt;      /* bytes sent with too fast SCK */
+	unsigned long collisions;   /* SPDR written during transfer */
+} emu_stats_t;
+
+extern unsigned long long emu_cycles;
+extern emu_stats_t emu_stats;
+
+/* apply register writes done since the last access */
+void emu_sync(void);
+
+/* let simulated time pass, runs the timer 0 interrupt */
+void emu_advance(unsigned long cycles);
+
+/* main loop reached usbPoll() */
+void emu_polled(void);
+
+void emu_init(void);
+
+/* target model: AVR in serial programming mode */
+extern unsigned long target_clock;
+
+void target_init(void);
+
+/* exchange one byte over hardware SPI, halfperiod is the SCK half period
+   in CPU cycles. returns the byte shifted out by the target */
+uchar target_exchange(uchar mosi, unsigned long halfperiod);
+
+/* pin levels changed (software SPI, reset) */
+void target_pins(uchar rst, uchar sck, uchar mosi);
+
+/* level of MISO */
+uchar target_miso(void);
+
+/* level the target drives on MOSI (TPIDATA), 1 if it doesn't */
+uchar target_data(void);
+
+/* target memories, for verification by the simulated host */
+uchar *target_flash(unsigned long *size);
+uchar *target_eeprom(unsigned long *size);
+
+/* replace the AVR with a 25 series SPI flash, RST is its chip select */
+void target_attach_norflash(void);
+
+/* SPI flash model used by the target */
+void norflash_init(void);
+void norflash_select(uchar selected);
+
+/* one byte while selected, returns the byte to shift out next */
+uchar norflash_byte(uchar in);
+
+uchar *norflash_memory(unsigned long *size);
+
+/* replace the AVR with an ATtiny10 on TPI, SCK is TPICLK */
+void target_attach_tiny(void);
+
+/* ATtiny10 model used by the target */
+void tiny_init(void);
+void tiny_pins(uchar rst, uchar clk, uchar data);
+uchar tiny_data(void);
+uchar *tiny_flash(unsigned long *size);
+
+#endif /* __emu_h_included__ */
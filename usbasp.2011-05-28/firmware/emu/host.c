@@ -0,0 +1,1161 @@
+/*
+ * host.c - part of USBasp
+ *
+ * Description....: Host side emulator: V-USB stand-in and a simulated host
+ *                  running an avrdude like session against the firmware.
+ *                  the host runs as a coroutine entered from usbPoll(), one
+ *                  USB transaction per main loop turn
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include "usbasp.h"
+#include "usbdrv.h"
+#include "clock.h"
+#include "spiflash.h"
+#include "tpi_defs.h"
+#include "emu.h"
+
+int usbasp_main(void);
+
+/* low speed USB: one bit is 8 CPU cycles. packets with sync, PID, CRC,
+   EOP and inter packet gap in bits */
+#define USB_BIT_CYCLES     8
+#define USB_BITS_TOKEN     40
+#define USB_BITS_DATA(n)   (((n) + 4) * 8 + 8)
+#define USB_BITS_HANDSHAKE 24
+
+#define USB_TX_NAK        -1
+#define USB_TX_STALL      -2
+
+#define HOST_FRAME        EMU_CYCLES_US(1000)
+#define HOST_TIMEOUT      EMU_CYCLES_US(5000000)
+
+/* V-USB interface used by the firmware */
+uchar *usbMsgPtr;
+volatile schar usbRxLen;
+usbTxStatus_t usbTxStatus1;
+
+static uchar usb_rxbuf[8];
+static uchar usb_rxsetup;
+static uchar usb_txbuf[8];
+static schar usb_txlen = USB_TX_NAK;
+static usbMsgLen_t usb_msglen = USB_NO_MSG;
+static uchar usb_userrw;
+
+/* simulated host */
+static ucontext_t host_context;
+static ucontext_t fw_context;
+static char host_stack[256 * 1024];
+
+static unsigned long long host_frame = ~0ULL;
+static unsigned int host_budget;
+static unsigned int host_perframe = 1;
+
+static uchar *host_stream;
+static unsigned int host_streamlen;
+
+static uchar host_sck = USBASP_ISP_SCK_AUTO;
+static int host_pollmode = -1;
+static unsigned int host_flashsize = 8192;
+static unsigned int host_eepromsize = 128;
+static unsigned int host_blocksize = 200;
+static uchar host_usestream = 0;
+
+static emu_stats_t host_opstart;
+static uchar host_errors = 0;
+
+void usbInit(void) {
+	usbTxStatus1.len = USBPID_NAK;
+}
+
+void usbSetInterrupt(uchar *data, uchar len) {
+	memcpy(usbTxStatus1.buffer, data, len);
+	usbTxStatus1.len = len + 4;
+}
+
+/* usbProcessRx() of V-USB. usbRequest_t isn't used, its words are
+   unsigned int (4 bytes on the host) */
+static void usbProcessRx() {
+	usbMsgLen_t replyLen;
+	uchar rval;
+
+	if (usb_rxsetup) {
+		usb_txlen = USB_TX_NAK;
+		usb_userrw = 0;
+		replyLen = usbFunctionSetup(usb_rxbuf);
+		if (replyLen == USB_NO_MSG) {
+			if ((usb_rxbuf[0] & USBRQ_DIR_MASK) != USBRQ_DIR_HOST_TO_DEVICE) {
+				replyLen = usb_rxbuf[6];
+			}
+			usb_userrw = 1;
+		} else if (!usb_rxbuf[7] && (replyLen > usb_rxbuf[6])) {
+			replyLen = usb_rxbuf[6];
+		}
+		usb_msglen = replyLen;
+	} else if (usb_userrw) {
+		rval = usbFunctionWrite(usb_rxbuf, usbRxLen - 3);
+		if (rval == 0xff) {
+			usb_txlen = USB_TX_STALL;
+		} else if (rval != 0) {
+			usb_msglen = 0;
+		}
+	}
+}
+
+/* usbBuildTxBlock() of V-USB */
+static void usbBuildTxBlock() {
+	usbMsgLen_t wantLen;
+	uchar len = 0;
+
+	wantLen = (usb_msglen > 8) ? 8 : usb_msglen;
+	usb_msglen -= wantLen;
+
+	if (wantLen > 0) {
+		if (usb_userrw) {
+			len = usbFunctionRead(usb_txbuf, wantLen);
+		} else {
+			memcpy(usb_txbuf, usbMsgPtr, wantLen);
+			usbMsgPtr += wantLen;
+			len = wantLen;
+		}
+	}
+
+	if (len <= 8) {
+		usb_txlen = len;
+		if (len < 8)
+			usb_msglen = USB_NO_MSG;
+	} else {
+		usb_txlen = USB_TX_STALL;
+		usb_msglen = USB_NO_MSG;
+	}
+}
+
+void usbPoll(void) {
+
+	emu_sync();
+	emu_advance(EMU_LOOP_CYCLES);
+	emu_polled();
+
+	if (usbRxLen > 0) {
+		usbProcessRx();
+		if (usbRxLen > 0)
+			usbRxLen = 0;
+	}
+
+	if ((usb_txlen < 0) && (usb_msglen != USB_NO_MSG)) {
+		usbBuildTxBlock();
+	}
+
+	/* the host does one transaction (or nothing) */
+	swapcontext(&fw_context, &host_context);
+}
+
+/* bus time of a transaction, the USB interrupt runs meanwhile */
+static void hostBus(unsigned int bits) {
+	emu_advance(bits * USB_BIT_CYCLES);
+	emu_stats.usb++;
+}
+
+/* let the firmware run one main loop turn, poll the interrupt endpoint
+   at the start of a frame */
+static void hostYield() {
+	unsigned long long frame;
+
+	swapcontext(&host_context, &fw_context);
+
+	frame = emu_cycles / HOST_FRAME;
+	if (frame == host_frame)
+		return;
+
+	host_frame = frame;
+	host_budget = host_perframe;
+
+	if ((host_stream != NULL) && ((frame % USB_CFG_INTR_POLL_INTERVAL) == 0)) {
+		if ((usbRxLen > 0) || (usbTxStatus1.len & 0x10)) {
+			hostBus(USB_BITS_TOKEN + USB_BITS_HANDSHAKE);
+			emu_stats.naks++;
+		} else {
+			uchar len = usbTxStatus1.len - 4;
+			if (len > host_streamlen)
+				len = host_streamlen;
+			memcpy(host_stream, usbTxStatus1.buffer, len);
+			host_stream += len;
+			host_streamlen -= len;
+			usbTxStatus1.len = USBPID_NAK;
+			hostBus(USB_BITS_TOKEN + USB_BITS_DATA(len) + USB_BITS_HANDSHAKE);
+		}
+	}
+}
+
+static void hostFail(const char *what) {
+	fprintf(stderr, "host: %s\n", what);
+	exit(1);
+}
+
+/* wait for a transaction slot in the current or a later frame */
+static void hostSlot(unsigned long long start) {
+
+	for (;;) {
+		hostYield();
+		if (emu_cycles - start > HOST_TIMEOUT)
+			hostFail("device doesn't answer");
+		if (host_budget) {
+			host_budget--;
+			return;
+		}
+	}
+}
+
+static void hostSleep(unsigned long us) {
+	unsigned long long end = emu_cycles + EMU_CYCLES_US(us);
+
+	while (emu_cycles < end) {
+		hostYield();
+	}
+}
+
+/* SETUP or OUT transaction, NAKed while the receive buffer is in use */
+static void hostOut(uchar setup, uchar *data, uchar len) {
+	unsigned long long start = emu_cycles;
+
+	for (;;) {
+		hostSlot(start);
+		if (usbRxLen != 0) {
+			hostBus(USB_BITS_TOKEN + USB_BITS_DATA(len) + USB_BITS_HANDSHAKE);
+			emu_stats.naks++;
+			continue;
+		}
+		/* zero sized packets are status stages, V-USB drops them */
+		if (len > 0) {
+			memset(usb_rxbuf, 0, sizeof(usb_rxbuf));
+			memcpy(usb_rxbuf, data, len);
+			usb_rxsetup = setup;
+			usbRxLen = len + 3;
+		}
+		hostBus(USB_BITS_TOKEN + USB_BITS_DATA(len) + USB_BITS_HANDSHAKE);
+		return;
+	}
+}
+
+/* IN transaction, returns received length or -1 on stall */
+static int hostIn(uchar *data) {
+	unsigned long long start = emu_cycles;
+	int len;
+
+	for (;;) {
+		hostSlot(start);
+		if ((usbRxLen > 0) || (usb_txlen == USB_TX_NAK)) {
+			hostBus(USB_BITS_TOKEN + USB_BITS_HANDSHAKE);
+			emu_stats.naks++;
+			continue;
+		}
+		if (usb_txlen == USB_TX_STALL) {
+			hostBus(USB_BITS_TOKEN + USB_BITS_HANDSHAKE);
+			return -1;
+		}
+		len = usb_txlen;
+		memcpy(data, usb_txbuf, len);
+		usb_txlen = USB_TX_NAK;
+		hostBus(USB_BITS_TOKEN + USB_BITS_DATA(len) + USB_BITS_HANDSHAKE);
+		return len;
+	}
+}
+
+/* vendor request as sent by avrdude, returns transferred length or -1 */
+static int hostControl(uchar in, uchar request, unsigned int value,
+		unsigned int index, uchar *buffer, unsigned int len) {
+	uchar setup[8];
+	uchar packet[8];
+	unsigned int n;
+	int r;
+
+	setup[0] = USBRQ_TYPE_VENDOR | USBRQ_RCPT_DEVICE | (in
+			? USBRQ_DIR_DEVICE_TO_HOST : USBRQ_DIR_HOST_TO_DEVICE);
+	setup[1] = request;
+	setup[2] = value;
+	setup[3] = value >> 8;
+	setup[4] = index;
+	setup[5] = index >> 8;
+	setup[6] = len;
+	setup[7] = len >> 8;
+	hostOut(1, setup, 8);
+
+	if (in) {
+		n = 0;
+		do {
+			r = hostIn(packet);
+			if (r < 0)
+				return -1;
+			if (r > (int) (len - n))
+				r = len - n;
+			if (r > 0)
+				memcpy(buffer + n, packet, r);
+			n += r;
+		} while ((r == 8) && (n < len));
+		hostOut(0, NULL, 0);
+		return n;
+	}
+
+	for (n = 0; n < len; n += 8) {
+		hostOut(0, buffer + n, (len - n > 8) ? 8 : len - n);
+	}
+
+	return (hostIn(packet) == 0) ? (int) len : -1;
+}
+
+static void hostSetLongAddress(unsigned long address) {
+	uchar reply[4];
+
+	hostControl(1, USBASP_FUNC_SETLONGADDRESS, address & 0xFFFF, address
+			>> 16, reply, sizeof(reply));
+}
+
+static uchar hostTransmit(uchar b0, uchar b1, uchar b2, uchar b3) {
+	uchar reply[4] = { 0, 0, 0, 0 };
+
+	hostControl(1, USBASP_FUNC_TRANSMIT, (b1 << 8) | b0, (b3 << 8) | b2,
+			reply, 4);
+
+	return reply[3];
+}
+
+static void hostBegin() {
+	host_opstart = emu_stats;
+}
+
+/* print counters since hostBegin(). errs are instructions sent to the busy
+   target, bytes sent with too fast SCK and SPI write collisions */
+static void hostEnd(const char *name, unsigned int bytes) {
+	emu_stats_t *s = &emu_stats;
+	emu_stats_t *b = &host_opstart;
+	double ms = (double) (s->cycles - b->cycles) / EMU_CYCLES_US(1000);
+
+	printf("%-14s %6u %9.2f %7.2f %7lu %6lu %5lu %6lu %5lu %4lu\n", name,
+			bytes, ms, (bytes && (ms > 0)) ? bytes / ms : 0.0, s->spi - b->spi,
+			s->usb - b->usb, s->naks - b->naks, s->writes - b->writes,
+			s->polls - b->polls, (s->violations - b->violations) + (s->corrupt
+					- b->corrupt) + (s->collisions - b->collisions));
+}
+
+static void hostCheck(const char *name, uchar *expected, uchar *data,
+		unsigned int len) {
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		if (expected[i] != data[i]) {
+			printf("%s: mismatch at 0x%04x: 0x%02x != 0x%02x\n", name, i,
+					data[i], expected[i]);
+			host_errors++;
+			return;
+		}
+	}
+}
+
+static uchar hostStatus() {
+	uchar status = 0;
+
+	if (hostControl(1, USBASP_FUNC_GETSTATUS, 0, 0, &status, 1) != 1)
+		hostFail("GETSTATUS failed");
+
+	return status;
+}
+
+/* poll GETSTATUS while one of flags is set */
+static void hostWaitStatus(uchar flags) {
+
+	while (hostStatus() & flags) {
+		hostSleep(2000);
+	}
+}
+
+/* little endian value of n bytes */
+static unsigned long hostLE(uchar *data, uchar n) {
+	unsigned long value = 0;
+
+	while (n--) {
+		value = (value << 8) | data[n];
+	}
+
+	return value;
+}
+
+/* RLE data of n bytes (see PROG_BLOCKFLAG_RLE), returns its length */
+static unsigned int hostEncodeRLE(uchar *out, uchar *in, unsigned int n) {
+	unsigned int len = 2, i = 0, start, run;
+
+	out[0] = n;
+	out[1] = n >> 8;
+
+	while (i < n) {
+		for (run = 1; (i + run < n) && (in[i + run] == in[i]) && (run < 129);
+				run++)
+			;
+		if (run >= 2) {
+			out[len++] = 0x80 | (run - 2);
+			out[len++] = in[i];
+			i += run;
+			continue;
+		}
+
+		/* literal bytes up to the next run */
+		start = i;
+		while ((i < n) && (i - start < 128) && !((i + 1 < n) && (in[i + 1]
+				== in[i]))) {
+			i++;
+		}
+		out[len++] = i - start - 1;
+		memcpy(out + len, in + start, i - start);
+		len += i - start;
+	}
+
+	return len;
+}
+
+/* one WRITEFLASH/WRITEEEPROM request of n bytes, RLE encoded here if set
+   in blockflags. returns 0 if the firmware stalled it because a slow
+   commit kept its page buffers full, the rest goes from hostResume() on */
+static uchar hostWriteBlock(uchar request, unsigned int value, uchar *data,
+		unsigned int n, unsigned int pagesize, uchar blockflags) {
+	uchar *rle = NULL;
+	unsigned int index;
+	int r;
+
+	index = (pagesize & 0xFF) | ((blockflags | ((pagesize & 0xF00) >> 4))
+			<< 8);
+	if (blockflags & PROG_BLOCKFLAG_RLE) {
+		rle = malloc(2 * n + 4);
+		n = hostEncodeRLE(rle, data, n);
+		data = rle;
+	}
+	r = hostControl(0, request, value, index, data, n);
+	free(rle);
+
+	if (r < 0) {
+		hostWaitStatus(USBASP_STATUS_FULL);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* address a stalled write continues at, between first and last */
+static unsigned long hostResume(unsigned long first, unsigned long last) {
+	uchar status[5];
+	unsigned long address;
+
+	if (hostControl(1, USBASP_FUNC_GETSTATUS, 0, 0, status, 5) != 5)
+		hostFail("GETSTATUS failed");
+	address = hostLE(status + 1, 4);
+	if ((address < first) || (address > last))
+		hostFail("write stalled");
+
+	return address;
+}
+
+/* block flags for n bytes at offset of size */
+static uchar hostBlockFlags(uchar flags, unsigned int offset,
+		unsigned int n, unsigned int size) {
+
+	if (offset == 0)
+		flags |= PROG_BLOCKFLAG_FIRST;
+	if (offset + n == size)
+		flags |= PROG_BLOCKFLAG_LAST;
+
+	return flags;
+}
+
+static void hostWrite(uchar request, uchar *image, unsigned int size,
+		unsigned int pagesize, uchar flags) {
+	unsigned int address, n;
+
+	for (address = 0; address < size;) {
+		n = (size - address > host_blocksize) ? host_blocksize : size
+				- address;
+		hostSetLongAddress(address);
+		if (hostWriteBlock(request, address & 0xFFFF, image + address, n,
+				pagesize, hostBlockFlags(flags, address, n, size))) {
+			address += n;
+		} else {
+			address = hostResume(address, address + n);
+		}
+	}
+
+	/* the last pages may still go to the target */
+	hostWaitStatus(USBASP_STATUS_BUSY);
+}
+
+static void hostRead(uchar request, uchar *data, unsigned int size) {
+	unsigned int address, n;
+
+	for (address = 0; address < size; address += n) {
+		n = (size - address > host_blocksize) ? host_blocksize : size
+				- address;
+		hostSetLongAddress(address);
+		if (hostControl(1, request, address & 0xFFFF, 0, data + address, n)
+				!= (int) n) {
+			hostFail("read failed");
+		}
+	}
+}
+
+static void hostReadStream(uchar *data, unsigned int size) {
+
+	hostSetLongAddress(0);
+	host_stream = data;
+	host_streamlen = size;
+	hostControl(0, USBASP_FUNC_STREAM, 0, size, NULL, 0);
+
+	while (host_streamlen) {
+		hostYield();
+	}
+	host_stream = NULL;
+}
+
+/* CRCs as computed by GETCRC and PAGEHASH */
+static unsigned int hostCRC16(uchar *data, unsigned int len) {
+	unsigned int crc = 0xFFFF;
+	uchar i;
+
+	while (len--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+		}
+	}
+
+	return crc;
+}
+
+static unsigned long hostCRC32(uchar *data, unsigned int len) {
+	unsigned long crc = 0xFFFFFFFF;
+	uchar i;
+
+	while (len--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		}
+	}
+
+	return ~crc & 0xFFFFFFFF;
+}
+
+static void hostExpect(const char *name, int ok) {
+
+	if (!ok) {
+		printf("%s: unexpected result\n", name);
+		host_errors++;
+	}
+}
+
+/* GETCRC, BLANKCHECK and PAGEHASH: the request starts the check, the
+   repeated one returns the result */
+static int hostRunCheck(uchar request, unsigned int value,
+		unsigned int index, uchar *reply, unsigned int len) {
+	int r;
+
+	r = hostControl(1, request, value, index, reply, len);
+	if (r != 0)
+		return r;
+	hostWaitStatus(USBASP_STATUS_CHECK);
+
+	return hostControl(1, request, value, index, reply, len);
+}
+
+static void hostGetCRC(uchar *caps, uchar *image, uchar *eeimage) {
+	uchar reply[4];
+
+	hostBegin();
+	hostSetLongAddress(0);
+	hostExpect("GETCRC flash", (hostRunCheck(USBASP_FUNC_GETCRC, 0,
+			host_flashsize, reply, 2) == 2) && (hostLE(reply, 2)
+			== hostCRC16(image, host_flashsize)));
+	hostSetLongAddress(0);
+	hostExpect("GETCRC eeprom", (hostRunCheck(USBASP_FUNC_GETCRC,
+			USBASP_CRC_EEPROM << 8, host_eepromsize, reply, 2) == 2)
+			&& (hostLE(reply, 2) == hostCRC16(eeimage, host_eepromsize)));
+	if (caps[2] & USBASP_CAP_2_CRC32) {
+		hostSetLongAddress(0);
+		hostExpect("GETCRC CRC-32", (hostRunCheck(USBASP_FUNC_GETCRC,
+				USBASP_CRC_32 << 8, host_flashsize, reply, 4) == 4) && (hostLE(
+				reply, 4) == hostCRC32(image, host_flashsize)));
+	}
+
+	/* a request using the target cancels the check */
+	hostSetLongAddress(0);
+	hostControl(1, USBASP_FUNC_GETCRC, 0, host_flashsize, reply, 2);
+	hostTransmit(0x30, 0, 0, 0);
+	hostExpect("GETCRC cancelled", !(hostStatus() & USBASP_STATUS_CHECK));
+	hostEnd("crc", host_flashsize + host_eepromsize);
+}
+
+/* the image and the erased flash behind it */
+static void hostBlankCheck(uchar *image) {
+	uchar reply[5];
+	unsigned long tsize;
+	unsigned int first, n;
+
+	for (first = 0; (first < host_flashsize) && (image[first] == 0xFF); first++)
+		;
+	target_flash(&tsize);
+	n = (tsize - host_flashsize > 256) ? 256 : tsize - host_flashsize;
+
+	hostBegin();
+	hostSetLongAddress(0);
+	hostExpect("BLANKCHECK image", (hostRunCheck(USBASP_FUNC_BLANKCHECK, 0,
+			host_flashsize, reply, 5) == 5) && (reply[0] == ((first
+			< host_flashsize) ? USBASP_NOT_BLANK : USBASP_BLANK)) && (hostLE(
+			reply + 1, 4) == first));
+	if (n) {
+		hostSetLongAddress(host_flashsize);
+		hostExpect("BLANKCHECK erased", (hostRunCheck(USBASP_FUNC_BLANKCHECK,
+				0, n, reply, 5) == 5) && (reply[0] == USBASP_BLANK) && (hostLE(
+				reply + 1, 4) == host_flashsize + n));
+	}
+	hostEnd("blank check", first + n);
+}
+
+/* hashes of all pages, as many per request as the firmware allows */
+static void hostPageHash(uchar *caps, uchar *image) {
+	unsigned int pages = host_flashsize / 128;
+	unsigned int max = hostLE(caps + 20, 2) / 2;
+	uchar *hashes = malloc(2 * pages + 254);
+	unsigned int i, n;
+
+	hostBegin();
+	for (i = 0; i < pages; i += n) {
+		n = (pages - i > max) ? max : pages - i;
+		hostSetLongAddress(128 * i);
+		hostExpect("PAGEHASH", hostRunCheck(USBASP_FUNC_PAGEHASH, 0, 128,
+				hashes + 2 * i, 2 * n) == (int) (2 * n));
+	}
+	for (i = 0; i < pages; i++) {
+		if (hostLE(hashes + 2 * i, 2) != hostCRC16(image + 128 * i, 128)) {
+			printf("PAGEHASH: page %u differs\n", i);
+			host_errors++;
+			break;
+		}
+	}
+	/* V-USB replies up to 254 bytes, and that's the largest limit */
+	if (2 * max + 2 <= 254)
+		hostExpect("PAGEHASH too long", hostControl(1, USBASP_FUNC_PAGEHASH,
+				0, 128, hashes, 2 * max + 2) < 0);
+	hostEnd("page hashes", pages * 128);
+
+	free(hashes);
+}
+
+/* signature and first flash byte by raw SPI, as much as the firmware's
+   TRANSMITBLOCK buffer holds */
+static void hostTransmitBlock(uchar *caps, uchar *signature, uchar *image) {
+	uchar mosi[16] = { 0x30, 0, 0, 0, 0x30, 0, 1, 0, 0x30, 0, 2, 0, 0x20,
+			0, 0, 0 };
+	uchar expected[4] = { signature[0], signature[1], signature[2], image[0] };
+	uchar miso[16];
+	unsigned int len = hostLE(caps + 10, 2);
+	unsigned int i;
+
+	len = ((len > 16) ? 16 : len) & ~3;
+
+	hostBegin();
+	hostExpect("TRANSMITBLOCK out", hostControl(0,
+			USBASP_FUNC_TRANSMITBLOCK, 0, 0, mosi, len) == (int) len);
+	hostExpect("TRANSMITBLOCK in", hostControl(1, USBASP_FUNC_TRANSMITBLOCK,
+			0, 0, miso, len) == (int) len);
+	for (i = 0; i < len / 4; i++) {
+		hostExpect("TRANSMITBLOCK data", miso[4 * i + 3] == expected[i]);
+	}
+	hostEnd("transmitblock", len);
+}
+
+static void hostScript(uchar *signature, uchar *image) {
+	uchar script[] = { USBASP_SCRIPT_SPI_READ, 0x30, 0, 0, 0,
+			USBASP_SCRIPT_SPI_READ, 0x30, 0, 1, 0, USBASP_SCRIPT_SPI_READ,
+			0x30, 0, 2, 0, USBASP_SCRIPT_WAIT_READY, 10,
+			USBASP_SCRIPT_SPI_READ, 0x20, 0, 1, 0, USBASP_SCRIPT_END };
+	uchar result[5];
+
+	hostBegin();
+	hostExpect("SCRIPT out", hostControl(0, USBASP_FUNC_SCRIPT, 0, 0, script,
+			sizeof(script)) == sizeof(script));
+	hostExpect("SCRIPT results", (hostControl(1, USBASP_FUNC_SCRIPT, 0, 0,
+			result, 5) == 5) && (result[0] == USBASP_SCRIPT_OK) && (result[1]
+			== signature[0]) && (result[2] == signature[1]) && (result[3]
+			== signature[2]) && (result[4] == image[2]));
+	hostEnd("script", sizeof(script));
+}
+
+/* EEPROM with runs of equal bytes, written RLE encoded */
+static void hostRLE(uchar *data) {
+	uchar *image = malloc(host_eepromsize);
+	unsigned long tsize;
+	unsigned int i, seed = 7;
+
+	for (i = 0; i < host_eepromsize; i++) {
+		seed = seed * 1103515245 + 12345;
+		image[i] = (i & 0x10) ? seed >> 16 : i >> 5;
+	}
+
+	hostBegin();
+	hostWrite(USBASP_FUNC_WRITEEEPROM, image, host_eepromsize, 4,
+			PROG_BLOCKFLAG_PAGED | PROG_BLOCKFLAG_RLE);
+	hostRead(USBASP_FUNC_READEEPROM, data, host_eepromsize);
+	hostEnd("rle eeprom", host_eepromsize);
+	hostCheck("rle eeprom read back", image, data, host_eepromsize);
+	hostCheck("rle eeprom of target", image, target_eeprom(&tsize),
+			host_eepromsize);
+
+	free(image);
+}
+
+/* erase, then write every page but the erased ones and every third. maps
+   longer than the firmware's limit are stalled, then the host writes
+   densely */
+static void hostSparse(uchar *caps, uchar *image, uchar *data) {
+	unsigned int pages = host_flashsize / 128;
+	unsigned int maplen = (pages + 7) / 8;
+	unsigned int maxlen = hostLE(caps + 18, 2);
+	uchar *sparse = malloc(pages * 128 + 1);
+	uchar *packed = malloc(pages * 128 + 1);
+	uchar *map = malloc(maxlen + maplen + 1);
+	unsigned long tsize, address;
+	unsigned int i, p, len = 0, n;
+
+	memcpy(sparse, image, pages * 128);
+	memset(map, 0, maxlen + maplen + 1);
+	for (i = 0; i < pages; i++) {
+		if (i % 3 == 1)
+			memset(sparse + 128 * i, 0xFF, 128);
+		for (n = 0; (n < 128) && (sparse[128 * i + n] == 0xFF); n++)
+			;
+		if (n < 128) {
+			map[i >> 3] |= 1 << (i & 7);
+			memcpy(packed + len, sparse + 128 * i, 128);
+			len += 128;
+		}
+	}
+
+	hostBegin();
+	hostTransmit(0xAC, 0x80, 0, 0);
+	hostSleep(11000);
+	hostSetLongAddress(0);
+	hostExpect("SETPAGEMAP too long", hostControl(0, USBASP_FUNC_SETPAGEMAP,
+			0, 0, map, maxlen + 1) < 0);
+
+	if (maplen > maxlen) {
+		hostWrite(USBASP_FUNC_WRITEFLASH, sparse, pages * 128, 128, 0);
+		len = pages * 128;
+	} else {
+		hostExpect("SETPAGEMAP", hostControl(0, USBASP_FUNC_SETPAGEMAP, 0, 0,
+				map, maplen) == (int) maplen);
+
+		/* the firmware skips unmapped pages, the address continues */
+		hostSetLongAddress(0);
+		for (i = 0; i < len;) {
+			n = (len - i > host_blocksize) ? host_blocksize : len - i;
+			if (hostWriteBlock(USBASP_FUNC_WRITEFLASH, 0, packed + i, n, 128,
+					hostBlockFlags(0, i, n, len))) {
+				i += n;
+				continue;
+			}
+
+			/* stalled, continue at the packed data of the address */
+			address = hostResume(0, pages * 128);
+			hostSetLongAddress(address);
+			for (i = 0, p = 0; p < address / 128; p++) {
+				if (map[p >> 3] & (1 << (p & 7)))
+					i += 128;
+			}
+			if ((p < pages) && (map[p >> 3] & (1 << (p & 7))))
+				i += address % 128;
+		}
+		hostWaitStatus(USBASP_STATUS_BUSY);
+		hostControl(0, USBASP_FUNC_SETPAGEMAP, 0, 0, NULL, 0);
+	}
+
+	hostRead(USBASP_FUNC_READFLASH, data, pages * 128);
+	hostEnd("sparse write", len);
+	hostCheck("sparse read back", sparse, data, pages * 128);
+	hostCheck("sparse flash of target", sparse, target_flash(&tsize), pages
+			* 128);
+
+	free(map);
+	free(packed);
+	free(sparse);
+}
+
+/* poll SPIFLASH_STATUS until the write or erase is done */
+static void hostWaitFlash() {
+	uchar status;
+
+	for (;;) {
+		status = 0;
+		if (hostControl(1, USBASP_FUNC_SPIFLASH_STATUS, 0, 0, &status, 1) != 1)
+			hostFail("SPIFLASH_STATUS failed");
+		if (!(status & SPIFLASH_SR_WIP))
+			return;
+		hostSleep(1000);
+	}
+}
+
+/* the AVR is replaced by a W25Q32: erase a sector, write and read back */
+static void hostSPIFlash(uchar *image, uchar *data) {
+	unsigned int size = (host_flashsize > 512) ? 512 : host_flashsize;
+	unsigned int address, n;
+	unsigned long fsize;
+	uchar reply[3];
+
+	target_attach_norflash();
+
+	hostBegin();
+	hostControl(1, USBASP_FUNC_SPIFLASH_CONNECT, 0, 0, reply, 0);
+	hostExpect("SPIFLASH_ID", (hostControl(1, USBASP_FUNC_SPIFLASH_ID, 0, 0,
+			reply, 3) == 3) && (reply[0] == 0xEF) && (reply[1] == 0x40)
+			&& (reply[2] == 0x16));
+
+	hostSetLongAddress(0);
+	hostControl(1, USBASP_FUNC_SPIFLASH_ERASE, SPIFLASH_CMD_SE, 0, reply, 0);
+	hostWaitFlash();
+
+	/* a page program continues over requests */
+	hostSetLongAddress(0);
+	for (address = 0; address < size; address += n) {
+		n = (size - address > host_blocksize) ? host_blocksize : size
+				- address;
+		hostExpect("SPIFLASH_WRITE", hostControl(0,
+				USBASP_FUNC_SPIFLASH_WRITE, 0, 0, image + address, n)
+				== (int) n);
+	}
+	hostWaitFlash();
+
+	hostRead(USBASP_FUNC_SPIFLASH_READ, data, size);
+	hostControl(0, USBASP_FUNC_DISCONNECT, 0, 0, NULL, 0);
+	hostEnd("spi flash", size);
+	hostCheck("spi flash read back", image, data, size);
+	hostCheck("spi flash memory", image, norflash_memory(&fsize), size);
+}
+
+static uchar hostTPIRead() {
+	uchar b = 0;
+
+	if (hostControl(1, USBASP_FUNC_TPI_RAWREAD, 0, 0, &b, 1) != 1)
+		hostFail("TPI_RAWREAD failed");
+
+	return b;
+}
+
+static void hostTPIWrite(uchar b) {
+	hostControl(0, USBASP_FUNC_TPI_RAWWRITE, b, 0, NULL, 0);
+}
+
+/* TPI_CONNECT, with USBASP_TPI_AUTOCLOCK delay is the maximum. returns
+   the delay used */
+static unsigned int hostTPIConnect(uchar autoclock, unsigned int delay) {
+	uchar reply[3];
+
+	if (!autoclock) {
+		hostControl(1, USBASP_FUNC_TPI_CONNECT, delay, 0, reply, 0);
+		return delay;
+	}
+
+	if ((hostControl(1, USBASP_FUNC_TPI_CONNECT, delay, USBASP_TPI_AUTOCLOCK,
+			reply, 3) != 3) || (reply[2] != 0))
+		hostFail("TPI target doesn't answer");
+
+	return reply[0] | (reply[1] << 8);
+}
+
+/* the AVR is replaced by an ATtiny10: enable NVM access, erase, write and
+   read back its flash over TPI */
+static void hostTPI(uchar *caps, uchar *image, uchar *data) {
+	static const uchar key[8] = { 0xFF, 0x88, 0xD8, 0xCD, 0x45, 0xAB, 0x89,
+			0x12 };
+	unsigned int size = (host_flashsize > 1024) ? 1024 : host_flashsize & ~1;
+	unsigned int block = host_blocksize & ~1;
+	unsigned int address, n, delay;
+	unsigned long tsize;
+	uchar autoclock = (caps[1] & USBASP_CAP_1_TPI_AUTOCLOCK) != 0;
+	uchar signature[3];
+	uchar i;
+
+	target_attach_tiny();
+
+	/* phases of 3 target clocks, tpi.S delays 4 * delay + 7 cycles */
+	hostBegin();
+	delay = hostTPIConnect(autoclock, autoclock ? 1023 : 3 * EMU_F_CPU
+			/ target_clock / 4 + 1);
+	if (autoclock && (delay > 0)) {
+		/* the next faster delay tried must fail */
+		hostTPIConnect(0, (delay - 1) / 2);
+		hostTPIWrite(TPI_OP_SLDCS(TPIIR));
+		hostExpect("TPI autoclock", hostTPIRead() != TPIIR_ID);
+		hostTPIConnect(0, delay);
+	}
+	hostTPIWrite(TPI_OP_SSTCS(TPIPCR));
+	hostTPIWrite(TPIPCR_GT_2b);
+	hostTPIWrite(TPI_OP_SKEY);
+	for (i = 0; i < 8; i++) {
+		hostTPIWrite(key[i]);
+	}
+	do {
+		hostTPIWrite(TPI_OP_SLDCS(TPISR));
+	} while (!(hostTPIRead() & TPISR_NVMEN));
+	hostEnd("tpi connect", 0);
+
+	hostExpect("TPI signature", (hostControl(1, USBASP_FUNC_TPI_READBLOCK,
+			0x3FC0, 0, signature, 3) == 3) && (signature[0] == 0x1E)
+			&& (signature[1] == 0x90) && (signature[2] == 0x03));
+
+	/* chip erase starts with a write to the high byte of a flash word */
+	hostBegin();
+	hostTPIWrite(TPI_OP_SOUT(NVMCMD));
+	hostTPIWrite(NVMCMD_CHIP_ERASE);
+	hostTPIWrite(TPI_OP_SSTPR(0));
+	hostTPIWrite(0x01);
+	hostTPIWrite(TPI_OP_SSTPR(1));
+	hostTPIWrite(0x40);
+	hostTPIWrite(TPI_OP_SST);
+	hostTPIWrite(0xFF);
+	do {
+		hostTPIWrite(TPI_OP_SIN(NVMCSR));
+	} while (hostTPIRead() & NVMCSR_BSY);
+	hostEnd("tpi erase", 0);
+
+	/* the first block has a 16 bit length */
+	hostBegin();
+	for (address = 0; address < size; address += n) {
+		n = (address == 0) ? 512 : block;
+		if (n > size - address)
+			n = size - address;
+		hostExpect("TPI_WRITEBLOCK", hostControl(0,
+				USBASP_FUNC_TPI_WRITEBLOCK, 0x4000 + address, 0, image
+						+ address, n) == (int) n);
+	}
+	hostEnd("tpi write", size);
+
+	/* TPI_READBLOCK reads up to 254 bytes, 256 reads nothing */
+	hostBegin();
+	for (address = 0; address < size; address += n) {
+		n = (size - address > 254) ? 254 : size - address;
+		if (hostControl(1, USBASP_FUNC_TPI_READBLOCK, 0x4000 + address, 0,
+				data + address, n) != (int) n)
+			hostFail("TPI_READBLOCK failed");
+	}
+	hostEnd("tpi read", size);
+	hostExpect("TPI_READBLOCK 256", hostControl(1,
+			USBASP_FUNC_TPI_READBLOCK, 0x4000, 0, data + size, 256) == 0);
+
+	hostControl(0, USBASP_FUNC_TPI_DISCONNECT, 0, 0, NULL, 0);
+	hostCheck("tpi read back", image, data, size);
+	hostCheck("tpi flash", image, tiny_flash(&tsize), size);
+}
+
+static void hostSession() {
+	uchar *image, *eeimage, *data;
+	unsigned long tsize;
+	uchar reply[USBASP_CAPS_LENGTH];
+	uchar caps[USBASP_CAPS_LENGTH];
+	uchar signature[3];
+	clock_stats_t stats;
+	unsigned int i, seed;
+
+	image = malloc(host_flashsize);
+	eeimage = malloc(host_eepromsize);
+	data = malloc(host_flashsize + host_eepromsize);
+
+	/* pseudo random data with erased runs, some bytes equal 0xFF */
+	for (seed = 1, i = 0; i < host_flashsize; i++) {
+		seed = seed * 1103515245 + 12345;
+		image[i] = ((i & 0x7FF) >= 0x700) ? 0xFF : seed >> 16;
+	}
+	for (i = 0; i < host_eepromsize; i++) {
+		seed = seed * 1103515245 + 12345;
+		eeimage[i] = seed >> 16;
+	}
+
+	printf("operation       bytes        ms    kB/s     spi    usb  naks "
+		"writes polls errs\n");
+
+	hostBegin();
+	memset(reply, 0, sizeof(reply));
+	hostControl(1, USBASP_FUNC_GETCAPABILITIES, 0, 0, reply, sizeof(reply));
+	hostEnd("capabilities", 0);
+	memcpy(caps, reply, sizeof(caps));
+	if (host_usestream && !(caps[1] & USBASP_CAP_1_STREAM)) {
+		hostFail("firmware built without STREAM");
+	}
+
+	hostBegin();
+	if (host_pollmode >= 0) {
+		hostControl(1, USBASP_FUNC_SETPOLLMODE, host_pollmode, 0, reply, 1);
+	}
+	hostControl(1, USBASP_FUNC_SETISPSCK, host_sck, 0, reply, 1);
+	reply[0] = host_sck;
+	hostControl(1, USBASP_FUNC_CONNECT, 0, 0, reply, 1);
+	host_sck = reply[0];
+	if (hostControl(1, USBASP_FUNC_ENABLEPROG, 0, 0, reply, 1) != 1
+			|| reply[0] != 0) {
+		hostFail("target doesn't answer");
+	}
+	hostEnd("connect", 0);
+
+	hostBegin();
+	for (i = 0; i < 3; i++) {
+		signature[i] = hostTransmit(0x30, 0, i, 0);
+	}
+	hostEnd("signature", 3);
+
+	hostBegin();
+	hostTransmit(0xAC, 0x80, 0, 0);
+	hostSleep(11000);
+	hostEnd("chip erase", 0);
+
+	hostBegin();
+	hostWrite(USBASP_FUNC_WRITEFLASH, image, host_flashsize, 128, 0);
+	hostEnd("write flash", host_flashsize);
+
+	hostBegin();
+	if (host_usestream) {
+		hostReadStream(data, host_flashsize);
+	} else {
+		hostRead(USBASP_FUNC_READFLASH, data, host_flashsize);
+	}
+	hostEnd(host_usestream ? "stream flash" : "read flash", host_flashsize);
+	hostCheck("flash read back", image, data, host_flashsize);
+	hostCheck("flash of target", image, target_flash(&tsize), host_flashsize);
+
+	hostBegin();
+	hostWrite(USBASP_FUNC_WRITEEEPROM, eeimage, host_eepromsize, 4,
+			PROG_BLOCKFLAG_PAGED);
+	hostEnd("write eeprom", host_eepromsize);
+
+	hostBegin();
+	hostRead(USBASP_FUNC_READEEPROM, data, host_eepromsize);
+	hostEnd("read eeprom", host_eepromsize);
+	hostCheck("eeprom read back", eeimage, data, host_eepromsize);
+	hostCheck("eeprom of target", eeimage, target_eeprom(&tsize),
+			host_eepromsize);
+
+	/* round trips of the extensions the firmware reports */
+	if (caps[0] & USBASP_CAP_0_CRC)
+		hostGetCRC(caps, image, eeimage);
+	if (caps[0] & USBASP_CAP_0_BLANKCHECK)
+		hostBlankCheck(image);
+	if ((caps[1] & USBASP_CAP_1_PAGEHASH) && (host_flashsize >= 128))
+		hostPageHash(caps, image);
+	if (caps[0] & USBASP_CAP_0_TRANSMITBLOCK)
+		hostTransmitBlock(caps, signature, image);
+	if (caps[1] & USBASP_CAP_1_SCRIPT)
+		hostScript(signature, image);
+	if (caps[1] & USBASP_CAP_1_RLE)
+		hostRLE(data);
+	if ((caps[0] & USBASP_CAP_0_SPARSE) && (host_flashsize >= 128))
+		hostSparse(caps, image, data);
+
+	hostBegin();
+	hostControl(0, USBASP_FUNC_DISCONNECT, 0, 0, NULL, 0);
+	hostEnd("disconnect", 0);
+
+	if (caps[0] & USBASP_CAP_0_TPI)
+		hostTPI(caps, image, data);
+	if (caps[1] & USBASP_CAP_1_SPIFLASH)
+		hostSPIFlash(image, data);
+
+	memset(&stats, 0, sizeof(stats));
+	if (caps[1] & USBASP_CAP_1_STATS)
+		hostControl(1, USBASP_FUNC_GETSTATS, 0, 0, (uchar *) &stats,
+				sizeof(stats));
+
+	printf("\nsck option %u, signature %02x %02x %02x, target %lu Hz\n",
+			host_sck, signature[0], signature[1], signature[2], target_clock);
+	printf("total %.2f ms, %lu USB transactions, %lu SPI bytes\n",
+			(double) emu_cycles / EMU_CYCLES_US(1000), emu_stats.usb,
+			emu_stats.spi);
+	printf("target: %lu busy violations, %lu corrupt bytes, "
+		"%lu SPI collisions\n", emu_stats.violations, emu_stats.corrupt,
+			emu_stats.collisions);
+	if (caps[1] & USBASP_CAP_1_STATS)
+		printf("GETSTATS (ms): spi %.2f, flush %.2f, wait %.2f, polls %lu, "
+			"packets %lu\n", stats.spi * 64 / 12000.0, stats.flush * 64 / 12000.0,
+				stats.wait * 64 / 12000.0, stats.polls, stats.packets);
+
+	if (host_errors || emu_stats.violations) {
+		printf("FAILED\n");
+		exit(1);
+	}
+
+	printf("OK\n");
+	exit(0);
+}
+
+static void usage() {
+	fprintf(stderr, "usage: usbasp-emu [options]\n"
+		"  -s option   SCK option (USBASP_ISP_SCK_*), default 0 (auto)\n"
+		"  -f hz       target clock, default 1000000\n"
+		"  -n bytes    flash bytes to write and verify, default 8192\n"
+		"  -e bytes    EEPROM bytes to write and verify, default 128\n"
+		"  -b bytes    bytes per USB request, default 200\n"
+		"  -p mode     write polling (USBASP_POLL_*), default firmware's\n"
+		"  -t n        USB transactions per frame, default 1\n"
+		"  -m          read flash with STREAM (build with\n"
+		"              DEFINES=-DUSB_CFG_HAVE_INTRIN_ENDPOINT=1)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int c;
+
+	while ((c = getopt(argc, argv, "s:f:n:e:b:p:t:mh")) != -1) {
+		switch (c) {
+		case 's':
+			host_sck = atoi(optarg);
+			break;
+		case 'f':
+			target_clock = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			host_flashsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			host_eepromsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			host_blocksize = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			host_pollmode = atoi(optarg);
+			break;
+		case 't':
+			host_perframe = atoi(optarg);
+			break;
+		case 'm':
+			host_usestream = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((host_flashsize == 0) || (host_flashsize > 32768)
+			|| (host_eepromsize > 1024) || (host_blocksize == 0)
+			|| (host_blocksize > 254) || (host_perframe == 0)) {
+		usage();
+	}
+
+	emu_init();
+
+	getcontext(&host_context);
+	host_context.uc_stack.ss_sp = host_stack;
+	host_context.uc_stack.ss_size = sizeof(host_stack);
+	host_context.uc_link = NULL;
+	makecontext(&host_context, hostSession, 0);
+
+	return usbasp_main();
+}
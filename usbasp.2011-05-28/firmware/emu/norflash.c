@@ -0,0 +1,143 @@
+/*
+ * norflash.c - part of USBasp
+ *
+ * Description....: Host side emulator: behavioural model of a 25 series
+ *                  serial NOR flash (W25Q32) on the ISP connector, RST is
+ *                  the chip select. instructions used by spiflash.c only
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#include <string.h>
+#include "emu.h"
+#include "spiflash.h"
+
+#define NORFLASH_SIZE        0x400000
+#define NORFLASH_SECTOR      4096
+#define NORFLASH_BLOCK       65536
+
+/* typical times from the data sheet */
+#define NORFLASH_T_PP        700     /* us */
+#define NORFLASH_T_SE        45000
+#define NORFLASH_T_BE        150000
+#define NORFLASH_T_CE        10000000
+
+static const uchar norflash_id[3] = { 0xEF, 0x40, 0x16 };
+
+static uchar n_mem[NORFLASH_SIZE];
+static uchar n_page[SPIFLASH_PAGESIZE];
+
+static unsigned long long n_busy;
+static uchar n_wel;
+
+/* instruction of the current chip select cycle */
+static uchar n_selected;
+static uchar n_cmd;
+static unsigned long n_count;
+static unsigned long n_address;
+
+static uchar norflashBusy() {
+	return emu_cycles < n_busy;
+}
+
+static void norflashStartBusy(unsigned long us) {
+
+	n_busy = emu_cycles + EMU_CYCLES_US(us);
+	n_wel = 0;
+	emu_stats.writes++;
+}
+
+static void norflashErase(unsigned long size, unsigned long us) {
+
+	memset(n_mem + (n_address & (NORFLASH_SIZE - size)), 0xFF, size);
+	norflashStartBusy(us);
+}
+
+/* chip select released: write and erase instructions are executed */
+static void norflashExecute() {
+	unsigned long base, i;
+
+	if (n_cmd == SPIFLASH_CMD_WREN) {
+		n_wel = 1;
+		return;
+	}
+
+	if (!n_wel) {
+		return;
+	}
+
+	if ((n_cmd == SPIFLASH_CMD_PP) && (n_count > 4)) {
+		/* programming clears bits only */
+		base = n_address & ~(unsigned long) (SPIFLASH_PAGESIZE - 1);
+		for (i = 0; i < SPIFLASH_PAGESIZE; i++) {
+			n_mem[base + i] &= n_page[i];
+		}
+		norflashStartBusy(NORFLASH_T_PP);
+	} else if ((n_cmd == SPIFLASH_CMD_SE) && (n_count == 4)) {
+		norflashErase(NORFLASH_SECTOR, NORFLASH_T_SE);
+	} else if ((n_cmd == SPIFLASH_CMD_BE) && (n_count == 4)) {
+		norflashErase(NORFLASH_BLOCK, NORFLASH_T_BE);
+	} else if ((n_cmd == SPIFLASH_CMD_CE) && (n_count == 1)) {
+		norflashErase(NORFLASH_SIZE, NORFLASH_T_CE);
+	}
+}
+
+void norflash_select(uchar selected) {
+
+	if (selected == n_selected)
+		return;
+
+	n_selected = selected;
+	if (selected) {
+		n_count = 0;
+		n_address = 0;
+		memset(n_page, 0xFF, sizeof(n_page));
+	} else if (n_count) {
+		norflashExecute();
+	}
+}
+
+uchar norflash_byte(uchar in) {
+
+	if (!n_selected) {
+		return 0xFF;
+	}
+
+	if (n_count++ == 0) {
+		/* only the status can be read while busy */
+		n_cmd = in;
+		if (norflashBusy() && (n_cmd != SPIFLASH_CMD_RDSR)) {
+			emu_stats.violations++;
+			n_cmd = 0;
+		}
+	} else if (n_count <= 4) {
+		n_address = ((n_address << 8) | in) & (NORFLASH_SIZE - 1);
+	} else if (n_cmd == SPIFLASH_CMD_PP) {
+		/* page program wraps within the page */
+		n_page[(n_address + n_count - 5) & (SPIFLASH_PAGESIZE - 1)] &= in;
+	}
+
+	switch (n_cmd) {
+	case SPIFLASH_CMD_RDSR:
+		return (n_wel << 1) | norflashBusy();
+	case SPIFLASH_CMD_RDID:
+		return (n_count <= 3) ? norflash_id[n_count - 1] : 0xFF;
+	case SPIFLASH_CMD_FAST_READ:
+		/* data follows the dummy byte */
+		if (n_count >= 5)
+			return n_mem[(n_address + n_count - 5) & (NORFLASH_SIZE - 1)];
+		break;
+	}
+
+	return 0xFF;
+}
+
+uchar *norflash_memory(unsigned long *size) {
+	*size = NORFLASH_SIZE;
+	return n_mem;
+}
+
+void norflash_init(void) {
+	memset(n_mem, 0xFF, sizeof(n_mem));
+}
@@ -0,0 +1,356 @@
+/*
+ * target.c - part of USBasp
+ *
+ * Description....: Host side emulator: behavioural model of an ATmega328P
+ *                  in serial programming mode. flash, EEPROM, page buffers,
+ *                  write latencies and the SCK limit of the target clock
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#include <string.h>
+#include "emu.h"
+
+#define TARGET_FLASH_SIZE    32768
+#define TARGET_FLASH_PAGE    128     /* bytes */
+#define TARGET_EEPROM_SIZE   1024
+#define TARGET_EEPROM_PAGE   4
+
+/* write times from the data sheet */
+#define TARGET_T_FLASH       2600    /* us */
+#define TARGET_T_EEPROM      3600
+#define TARGET_T_ERASE       10500
+#define TARGET_T_FUSE        4500
+
+static const uchar target_signature[3] = { 0x1E, 0x95, 0x0F };
+
+unsigned long target_clock = 1000000;
+
+static uchar t_flash[TARGET_FLASH_SIZE];
+static uchar t_eeprom[TARGET_EEPROM_SIZE];
+static uchar t_pagebuf[TARGET_FLASH_PAGE];
+static uchar t_eepagebuf[TARGET_EEPROM_PAGE];
+static uchar t_eepageload;
+static uchar t_fuse[3] = { 0x62, 0xD9, 0xFF };
+static uchar t_lock = 0xFF;
+static uchar t_extended;
+
+/* busy until, the region being written reads 0xFF meanwhile */
+static unsigned long long t_busy;
+static unsigned long t_busyaddress;
+static unsigned long t_busylen;
+static uchar t_busyeeprom;
+
+/* serial programming interface */
+static uchar t_reset;
+static uchar t_enabled;
+static uchar t_cmd[4];
+static uchar t_index;
+static uchar t_out = 0xFF;
+
+/* software SPI: bit level shift register */
+static uchar t_sck;
+static uchar t_bits;
+static uchar t_shift;
+static uchar t_miso = 1;
+static uchar t_timing;
+static unsigned long long t_edge;
+
+/* a serial NOR flash or an ATtiny10 replaces the AVR */
+static uchar t_norflash;
+static uchar t_tiny;
+
+static uchar targetBusy() {
+	return emu_cycles < t_busy;
+}
+
+static void targetStartBusy(unsigned long us, uchar eeprom,
+		unsigned long address, unsigned long len) {
+
+	t_busy = emu_cycles + EMU_CYCLES_US(us);
+	t_busyeeprom = eeprom;
+	t_busyaddress = address;
+	t_busylen = len;
+	emu_stats.writes++;
+}
+
+/* minimum SCK high and low time is 2 target clocks, 3 from 12 MHz */
+static uchar targetSCKok(unsigned long long halfperiod) {
+	unsigned long n = (target_clock >= 12000000) ? 3 : 2;
+
+	if (t_norflash)
+		return 1;
+
+	return halfperiod * target_clock >= n * EMU_F_CPU;
+}
+
+static uchar targetReadFlash(unsigned long address) {
+
+	address %= TARGET_FLASH_SIZE;
+	if (targetBusy() && !t_busyeeprom && (address >= t_busyaddress)
+			&& (address < t_busyaddress + t_busylen)) {
+		return 0xFF;
+	}
+
+	return t_flash[address];
+}
+
+static uchar targetReadEEPROM(unsigned long address) {
+
+	address %= TARGET_EEPROM_SIZE;
+	if (targetBusy() && t_busyeeprom && (address >= t_busyaddress)
+			&& (address < t_busyaddress + t_busylen)) {
+		return 0xFF;
+	}
+
+	return t_eeprom[address];
+}
+
+/* 4th byte of read instructions */
+static uchar targetResult() {
+	unsigned long word = ((unsigned long) t_extended << 16) | (t_cmd[1] << 8)
+			| t_cmd[2];
+
+	switch (t_cmd[0]) {
+	case 0x30:
+		return (t_cmd[2] < 3) ? target_signature[t_cmd[2]] : 0x00;
+	case 0x20:
+		return targetReadFlash(word * 2);
+	case 0x28:
+		return targetReadFlash(word * 2 + 1);
+	case 0xA0:
+		return targetReadEEPROM((t_cmd[1] << 8) | t_cmd[2]);
+	case 0xF0:
+		emu_stats.polls++;
+		return targetBusy();
+	case 0x50:
+		return (t_cmd[1] == 0x08) ? t_fuse[2] : t_fuse[0];
+	case 0x58:
+		return (t_cmd[1] == 0x08) ? t_fuse[1] : t_lock;
+	case 0x38:
+		return 0x9A;
+	}
+
+	return t_cmd[2];
+}
+
+static void targetExecute() {
+	unsigned long address;
+	uchar i;
+
+	if (!t_enabled || ((t_cmd[0] == 0xAC) && (t_cmd[1] == 0x53))) {
+		return;
+	}
+
+	if ((t_cmd[0] == 0x4D) || (t_cmd[0] & 0xF0) == 0x20 || (t_cmd[0] == 0x30)
+			|| (t_cmd[0] == 0xA0) || (t_cmd[0] == 0xF0) || (t_cmd[0] == 0x38)
+			|| (t_cmd[0] == 0x50) || (t_cmd[0] == 0x58)) {
+		if (t_cmd[0] == 0x4D)
+			t_extended = t_cmd[2];
+		return;
+	}
+
+	/* everything else changes memory, ignored while busy */
+	if (targetBusy()) {
+		emu_stats.violations++;
+		return;
+	}
+
+	switch (t_cmd[0]) {
+	case 0x40:
+	case 0x48:
+		i = (t_cmd[2] * 2 + ((t_cmd[0] >> 3) & 1)) & (TARGET_FLASH_PAGE - 1);
+		t_pagebuf[i] = t_cmd[3];
+		break;
+
+	case 0x4C:
+		/* programming clears bits only */
+		address = (((unsigned long) t_extended << 17) | (t_cmd[1] << 9)
+				| (t_cmd[2] << 1)) & ~(unsigned long) (TARGET_FLASH_PAGE - 1);
+		address %= TARGET_FLASH_SIZE;
+		for (i = 0; i < TARGET_FLASH_PAGE; i++) {
+			t_flash[address + i] &= t_pagebuf[i];
+		}
+		memset(t_pagebuf, 0xFF, sizeof(t_pagebuf));
+		targetStartBusy(TARGET_T_FLASH, 0, address, TARGET_FLASH_PAGE);
+		break;
+
+	case 0xC0:
+		address = ((t_cmd[1] << 8) | t_cmd[2]) % TARGET_EEPROM_SIZE;
+		t_eeprom[address] = t_cmd[3];
+		targetStartBusy(TARGET_T_EEPROM, 1, address, 1);
+		break;
+
+	case 0xC1:
+		i = t_cmd[2] & (TARGET_EEPROM_PAGE - 1);
+		t_eepagebuf[i] = t_cmd[3];
+		t_eepageload |= 1 << i;
+		break;
+
+	case 0xC2:
+		address = ((t_cmd[1] << 8) | t_cmd[2]) & ~(TARGET_EEPROM_PAGE - 1);
+		address %= TARGET_EEPROM_SIZE;
+		for (i = 0; i < TARGET_EEPROM_PAGE; i++) {
+			if (t_eepageload & (1 << i))
+				t_eeprom[address + i] = t_eepagebuf[i];
+		}
+		t_eepageload = 0;
+		targetStartBusy(TARGET_T_EEPROM, 1, address, TARGET_EEPROM_PAGE);
+		break;
+
+	case 0xAC:
+		if (t_cmd[1] == 0x80) {
+			memset(t_flash, 0xFF, sizeof(t_flash));
+			memset(t_eeprom, 0xFF, sizeof(t_eeprom));
+			t_lock = 0xFF;
+			targetStartBusy(TARGET_T_ERASE, 0, 0, TARGET_FLASH_SIZE);
+		} else if ((t_cmd[1] & 0xF0) == 0xA0) {
+			t_fuse[(t_cmd[1] == 0xA8) ? 1 : (t_cmd[1] == 0xA4) ? 2 : 0]
+					= t_cmd[3];
+			targetStartBusy(TARGET_T_FUSE, 1, 0, 0);
+		} else if (t_cmd[1] == 0xE0) {
+			t_lock = t_cmd[3] | 0xC0;
+			targetStartBusy(TARGET_T_FUSE, 1, 0, 0);
+		}
+		break;
+	}
+}
+
+/* one byte received, returns the byte to shift out next */
+static uchar targetByte(uchar in) {
+
+	if (!t_reset) {
+		return 0xFF;
+	}
+
+	if (t_norflash) {
+		return norflash_byte(in);
+	}
+
+	t_cmd[t_index++] = in;
+
+	if (t_index == 2) {
+		/* programming enable is accepted at any time, echoes 0x53 */
+		if ((t_cmd[0] == 0xAC) && (t_cmd[1] == 0x53)) {
+			t_enabled = 1;
+		}
+		return t_enabled ? in : 0x00;
+	}
+
+	if (t_index == 3) {
+		return t_enabled ? targetResult() : 0x00;
+	}
+
+	if (t_index == 4) {
+		targetExecute();
+		t_index = 0;
+	}
+
+	return t_enabled ? in : 0x00;
+}
+
+uchar target_exchange(uchar mosi, unsigned long halfperiod) {
+	uchar miso = t_out;
+
+	if (!targetSCKok(halfperiod)) {
+		/* sampled at the wrong edges */
+		emu_stats.corrupt++;
+		mosi = (mosi >> 1) | 0x80;
+		miso = (miso << 1) | 1;
+	}
+
+	t_out = targetByte(mosi);
+
+	return miso;
+}
+
+void target_pins(uchar rst, uchar sck, uchar mosi) {
+
+	if (t_tiny) {
+		tiny_pins(rst, sck, mosi);
+		return;
+	}
+
+	if ((!rst) != t_reset) {
+		t_reset = !rst;
+		/* entering or leaving reset: programming logic starts over */
+		t_enabled = 0;
+		t_index = 0;
+		t_bits = 0;
+		t_timing = 1;
+		t_out = 0xFF;
+		t_miso = 1;
+		if (t_norflash)
+			norflash_select(t_reset);
+	}
+
+	if (sck == t_sck)
+		return;
+
+	if (!targetSCKok(emu_cycles - t_edge))
+		t_timing = 0;
+	t_edge = emu_cycles;
+	t_sck = sck;
+
+	if (!t_reset)
+		return;
+
+	if (sck) {
+		/* rising edge samples MOSI */
+		t_shift = (t_shift << 1) | mosi;
+		if (++t_bits == 8) {
+			if (!t_timing) {
+				emu_stats.corrupt++;
+				t_shift = (t_shift >> 1) | 0x80;
+			}
+			t_out = targetByte(t_shift);
+			emu_stats.spi++;
+			t_bits = 0;
+			t_timing = 1;
+		}
+	} else {
+		/* falling edge shifts out the next bit */
+		t_miso = (uchar) (t_out << t_bits) >> 7;
+	}
+}
+
+uchar target_miso(void) {
+	return t_reset ? t_miso : 1;
+}
+
+uchar target_data(void) {
+	return t_tiny ? tiny_data() : 1;
+}
+
+uchar *target_flash(unsigned long *size) {
+	*size = TARGET_FLASH_SIZE;
+	return t_flash;
+}
+
+uchar *target_eeprom(unsigned long *size) {
+	*size = TARGET_EEPROM_SIZE;
+	return t_eeprom;
+}
+
+void target_attach_norflash(void) {
+
+	t_tiny = 0;
+	t_norflash = 1;
+	norflash_select(t_reset);
+}
+
+void target_attach_tiny(void) {
+
+	t_norflash = 0;
+	norflash_select(0);
+	t_tiny = 1;
+}
+
+void target_init(void) {
+	memset(t_flash, 0xFF, sizeof(t_flash));
+	memset(t_eeprom, 0xFF, sizeof(t_eeprom));
+	memset(t_pagebuf, 0xFF, sizeof(t_pagebuf));
+	norflash_init();
+	tiny_init();
+}
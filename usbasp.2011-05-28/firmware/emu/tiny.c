@@ -0,0 +1,370 @@
+/*
+ * tiny.c - part of USBasp
+ *
+ * Description....: Host side emulator: behavioural model of an ATtiny10
+ *                  on TPI. frames on TPICLK/TPIDATA, guard time, break,
+ *                  NVM program enable key, chip erase, word write and the
+ *                  clock limit of the target clock
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#include <string.h>
+#include "emu.h"
+#include "tpi_defs.h"
+
+#define TINY_FLASH_BASE      0x4000
+#define TINY_FLASH_SIZE      1024
+#define TINY_SIGNATURE_BASE  0x3FC0
+
+/* NVM times, about those of the data sheet */
+#define TINY_T_WORD          2500    /* us */
+#define TINY_T_ERASE         10000
+
+/* idle bits needed after reset, low bits of a break */
+#define TINY_IDLE_BITS       16
+#define TINY_BREAK_BITS      12
+
+static const uchar tiny_signature[3] = { 0x1E, 0x90, 0x03 };
+
+/* NVM program enable key in the order it is sent after SKEY */
+static const uchar tiny_key[8] = { 0xFF, 0x88, 0xD8, 0xCD, 0x45, 0xAB,
+		0x89, 0x12 };
+
+/* idle bits before a response for the TPIPCR guard time values */
+static const uchar tiny_guard[8] = { 128, 64, 32, 16, 8, 4, 2, 0 };
+
+static uchar y_flash[TINY_FLASH_SIZE];
+
+/* TPI and NVM registers */
+static unsigned int y_pr;
+static uchar y_tpipcr;
+static uchar y_nvmen;
+static uchar y_nvmcmd;
+static uchar y_low;
+static unsigned long long y_busy;
+
+/* RST low enables TPI after TINY_IDLE_BITS high bits */
+static uchar y_reset;
+static uchar y_active;
+static uchar y_idle;
+static uchar y_zeros;
+
+/* a parity or frame error is ignored until a break */
+static uchar y_error;
+
+/* TPICLK edges: phases shorter than 2 target clocks corrupt the frame */
+static uchar y_clk;
+static unsigned long long y_edge;
+static uchar y_timing;
+
+/* frame being received: bits after the start bit, data and parity */
+static uchar y_rxbits;
+static uchar y_rxdata;
+static uchar y_rxparity;
+
+/* instruction waiting for operand bytes */
+static uchar y_cmd;
+static uchar y_operands;
+
+/* response: guard bits left, frame bits left (start bit first) */
+static uchar y_guard;
+static uchar y_txbits;
+static unsigned int y_txframe;
+static uchar y_out = 1;
+
+static uchar tinyBusy() {
+	return emu_cycles < y_busy;
+}
+
+static void tinyStartBusy(unsigned long us) {
+	y_busy = emu_cycles + EMU_CYCLES_US(us);
+	emu_stats.writes++;
+}
+
+static uchar tinyParity(uchar value) {
+	uchar parity = 0;
+
+	while (value) {
+		parity ^= value & 1;
+		value >>= 1;
+	}
+
+	return parity;
+}
+
+/* send value after the guard time */
+static void tinyRespond(uchar value) {
+
+	y_txframe = (3 << 10) | (tinyParity(value) << 9) | (value << 1);
+	y_txbits = 12;
+	y_guard = tiny_guard[y_tpipcr & 7];
+	y_timing = 1;
+}
+
+static uchar tinyFlashAddress(unsigned int address) {
+	return (address >= TINY_FLASH_BASE) && (address < TINY_FLASH_BASE
+			+ TINY_FLASH_SIZE);
+}
+
+/* data space read with SLD */
+static uchar tinyLoad(unsigned int address) {
+
+	if (!y_nvmen)
+		return 0;
+
+	if (tinyFlashAddress(address)) {
+		if (tinyBusy())
+			emu_stats.violations++;
+		return y_flash[address - TINY_FLASH_BASE];
+	}
+	if ((address >= TINY_SIGNATURE_BASE) && (address < TINY_SIGNATURE_BASE
+			+ sizeof(tiny_signature)))
+		return tiny_signature[address - TINY_SIGNATURE_BASE];
+
+	return 0xFF;
+}
+
+/* data space write with SST, starts the NVM command */
+static void tinyStore(unsigned int address, uchar value) {
+
+	if (!y_nvmen || !tinyFlashAddress(address))
+		return;
+	if (tinyBusy()) {
+		emu_stats.violations++;
+		return;
+	}
+
+	switch (y_nvmcmd) {
+	case NVMCMD_CHIP_ERASE:
+	case NVMCMD_SECTION_ERASE:
+		memset(y_flash, 0xFF, sizeof(y_flash));
+		tinyStartBusy(TINY_T_ERASE);
+		break;
+	case NVMCMD_WORD_WRITE:
+		/* the high byte writes the word, bits are only cleared */
+		address -= TINY_FLASH_BASE;
+		if (!(address & 1)) {
+			y_low = value;
+		} else {
+			y_flash[address - 1] &= y_low;
+			y_flash[address] &= value;
+			y_low = 0xFF;
+			tinyStartBusy(TINY_T_WORD);
+		}
+		break;
+	}
+}
+
+static uchar tinyIn(uchar address) {
+
+	if (address == NVMCSR)
+		return tinyBusy() ? NVMCSR_BSY : 0;
+	if (address == NVMCMD)
+		return y_nvmcmd;
+
+	return 0;
+}
+
+static uchar tinyLoadCS(uchar address) {
+
+	switch (address) {
+	case TPIIR:
+		return TPIIR_ID;
+	case TPIPCR:
+		return y_tpipcr;
+	case TPISR:
+		return y_nvmen ? TPISR_NVMEN : 0;
+	}
+
+	return 0;
+}
+
+/* execute a received byte: instruction or operand */
+static void tinyByte(uchar b) {
+
+	if (y_operands) {
+		y_operands--;
+
+		if (y_cmd == TPI_OP_SKEY) {
+			if (b != tiny_key[7 - y_operands])
+				y_cmd = 0; /* wrong key */
+			else if (y_operands == 0)
+				y_nvmen = 1;
+		} else if ((y_cmd & 0xFE) == TPI_OP_SSTPR(0)) {
+			if (y_cmd & 1)
+				y_pr = (y_pr & 0x00FF) | (b << 8);
+			else
+				y_pr = (y_pr & 0xFF00) | b;
+		} else if ((y_cmd & 0xFB) == TPI_OP_SST) {
+			tinyStore(y_pr, b);
+			if (y_cmd & 0x04)
+				y_pr++;
+		} else if ((y_cmd & 0x90) == 0x90) {
+			/* SOUT */
+			if ((((y_cmd >> 1) & 0x30) | (y_cmd & 0x0F)) == NVMCMD)
+				y_nvmcmd = b;
+		} else if ((y_cmd & 0xF0) == TPI_OP_SSTCS(0)) {
+			if ((y_cmd & 0x0F) == TPIPCR)
+				y_tpipcr = b & 7;
+			else if ((y_cmd & 0x0F) == TPISR)
+				y_nvmen = y_nvmen && (b & TPISR_NVMEN);
+		}
+		return;
+	}
+
+	y_cmd = b;
+	if (b == TPI_OP_SKEY) {
+		y_operands = 8;
+	} else if ((b & 0x90) == 0x10) {
+		/* SIN */
+		tinyRespond(tinyIn(((b >> 1) & 0x30) | (b & 0x0F)));
+	} else if ((b & 0x90) == 0x90) {
+		y_operands = 1; /* SOUT */
+	} else if ((b & 0xFB) == TPI_OP_SLD) {
+		tinyRespond(tinyLoad(y_pr));
+		if (b & 0x04)
+			y_pr++;
+	} else if (((b & 0xFB) == TPI_OP_SST) || ((b & 0xFE)
+			== TPI_OP_SSTPR(0))) {
+		y_operands = 1;
+	} else if ((b & 0xF0) == TPI_OP_SLDCS(0)) {
+		tinyRespond(tinyLoadCS(b & 0x0F));
+	} else if ((b & 0xF0) == TPI_OP_SSTCS(0)) {
+		y_operands = 1;
+	}
+}
+
+/* TPICLK rising edge samples TPIDATA */
+static void tinySample(uchar data) {
+
+	if (data) {
+		y_zeros = 0;
+	} else if (++y_zeros == TINY_BREAK_BITS) {
+		/* break: frames and responses are dropped */
+		y_error = 0;
+		y_rxbits = 0;
+		y_operands = 0;
+		y_txbits = 0;
+		y_out = 1;
+		return;
+	}
+
+	if (y_txbits) {
+		if (y_guard)
+			y_guard--;
+		return;
+	}
+
+	if (!y_active) {
+		if (data && (++y_idle >= TINY_IDLE_BITS))
+			y_active = 1;
+		return;
+	}
+
+	if (y_rxbits == 0) {
+		/* start bit */
+		if (!data && (y_zeros == 1) && !y_error) {
+			y_rxbits = 1;
+			y_rxdata = 0;
+			y_timing = 1;
+		}
+		return;
+	}
+
+	if (y_rxbits <= 8) {
+		y_rxdata |= data << (y_rxbits - 1);
+	} else if (y_rxbits == 9) {
+		y_rxparity = data;
+	} else if (!data) {
+		/* stop bit missing */
+		y_error = 1;
+	}
+
+	if (++y_rxbits < 12)
+		return;
+
+	y_rxbits = 0;
+	if (!y_timing) {
+		emu_stats.corrupt++;
+		y_error = 1;
+	}
+	if (y_rxparity != tinyParity(y_rxdata))
+		y_error = 1;
+	if (!y_error)
+		tinyByte(y_rxdata);
+}
+
+/* TPICLK falling edge drives the next response bit */
+static void tinyShift() {
+
+	if (!y_txbits || y_guard)
+		return;
+
+	if (y_txbits == 12)
+		y_timing = 1;
+	y_out = y_txframe & 1;
+	y_txframe >>= 1;
+	if (--y_txbits == 0) {
+		y_out = 1;
+		if (!y_timing)
+			emu_stats.corrupt++;
+	}
+}
+
+void tiny_pins(uchar rst, uchar clk, uchar data) {
+	unsigned long n = (target_clock >= 12000000) ? 3 : 2;
+
+	if ((!rst) != y_reset) {
+		/* TPI starts over, NVM access is disabled */
+		y_reset = !rst;
+		y_active = 0;
+		y_idle = 0;
+		y_zeros = 0;
+		y_error = 0;
+		y_rxbits = 0;
+		y_operands = 0;
+		y_txbits = 0;
+		y_out = 1;
+		y_tpipcr = 0;
+		y_nvmen = 0;
+		y_nvmcmd = NVMCMD_NOP;
+		y_low = 0xFF;
+	}
+
+	if (clk == y_clk)
+		return;
+
+	if ((emu_cycles - y_edge) * target_clock < n * EMU_F_CPU) {
+		/* too fast: the response sampled by the programmer is wrong */
+		if (y_timing && y_txbits && !y_guard)
+			y_txframe ^= 1;
+		y_timing = 0;
+	}
+	y_edge = emu_cycles;
+	y_clk = clk;
+
+	if (!y_reset)
+		return;
+
+	if (clk) {
+		tinySample(data);
+	} else {
+		tinyShift();
+	}
+}
+
+uchar tiny_data(void) {
+	return y_reset ? y_out : 1;
+}
+
+uchar *tiny_flash(unsigned long *size) {
+	*size = TINY_FLASH_SIZE;
+	return y_flash;
+}
+
+void tiny_init(void) {
+	memset(y_flash, 0xFF, sizeof(y_flash));
+	y_reset = 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * tpi.c - part of USBasp
+ *
+ * Description....: Host side emulator: tpi.S in C. the assembler can't run
+ *                  on the host, so this follows it port access by port
+ *                  access, delay loop cycles included. wiring without
+ *                  TPI_WITH_OPTO
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#include <avr/io.h>
+#include "emu.h"
+#include "tpi.h"
+#include "tpi_defs.h"
+
+#define TPI_CLK_PORT PORTB
+#define TPI_CLK_DDR DDRB
+#define TPI_CLK_BIT 5
+#define TPI_DATAOUT_PORT PORTB
+#define TPI_DATAOUT_DDR DDRB
+#define TPI_DATAOUT_BIT 3
+#define TPI_DATAIN_PIN PINB
+#define TPI_DATAIN_BIT 3
+
+/* rcall, ret and the loop around tpi_bit */
+#define TPI_BIT_CYCLES 8
+
+uint16_t tpi_dly_cnt;
+
+/* lds, lds and tpi_dly_cnt + 1 turns of sbiw, brsh */
+static void tpiDelay() {
+
+	emu_sync();
+	emu_advance(4 + 4 * (unsigned long) tpi_dly_cnt + 3);
+}
+
+/* exchange of one bit: TPIDATA = t, returns TPIDATA at the rising edge */
+static uchar tpiBit(uchar t) {
+
+	/* DATAOUT = pull-up, if(t == 0) DATAOUT = low */
+	TPI_DATAOUT_DDR &= ~(1 << TPI_DATAOUT_BIT);
+	TPI_DATAOUT_PORT |= (1 << TPI_DATAOUT_BIT);
+	if (!t) {
+		TPI_DATAOUT_PORT &= ~(1 << TPI_DATAOUT_BIT);
+		TPI_DATAOUT_DDR |= (1 << TPI_DATAOUT_BIT);
+	}
+	tpiDelay();
+	TPI_CLK_PORT |= (1 << TPI_CLK_BIT);
+	t = (TPI_DATAIN_PIN >> TPI_DATAIN_BIT) & 1;
+	tpiDelay();
+	TPI_CLK_PORT &= ~(1 << TPI_CLK_BIT);
+	emu_sync();
+	emu_advance(TPI_BIT_CYCLES);
+
+	return t;
+}
+
+void tpi_init(void) {
+	uchar i;
+
+	/* CLK <= out */
+	TPI_CLK_DDR |= (1 << TPI_CLK_BIT);
+	/* DATA <= pull-up */
+	TPI_DATAOUT_DDR &= ~(1 << TPI_DATAOUT_BIT);
+	TPI_DATAOUT_PORT |= (1 << TPI_DATAOUT_BIT);
+
+	/* 32 bits */
+	for (i = 0; i < 32; i++)
+		tpiBit(1);
+}
+
+void tpi_send_byte(uint8_t b) {
+	uchar i, parity = 0;
+
+	/* start bit */
+	tpiBit(0);
+	/* 8 data bits */
+	for (i = 0; i < 8; i++) {
+		parity ^= b;
+		tpiBit(b & 1);
+		b >>= 1;
+	}
+	/* parity bit */
+	tpiBit(parity & 1);
+	/* 2 stop bits */
+	tpiBit(1);
+	tpiBit(1);
+}
+
+/* no start bit or parity error: send 2 breaks (24++ bits), return 0 */
+static uint8_t tpiBreak() {
+	uchar i;
+
+	for (i = 0; i < 26; i++)
+		tpiBit(0);
+	tpiBit(1);
+
+	return 0;
+}
+
+uint8_t tpi_recv_byte(void) {
+	uchar i, b = 0, parity = 0;
+
+	/* waitfor(start_bit, 192); */
+	for (i = 0; i < 192; i++) {
+		if (!tpiBit(1))
+			break;
+	}
+	if (i == 192)
+		return tpiBreak();
+
+	/* recv 8bits(+calc.parity) */
+	for (i = 0; i < 8; i++) {
+		b = (b >> 1) | (tpiBit(1) << 7);
+		parity ^= b;
+	}
+	/* recv parity */
+	if ((tpiBit(1) << 7) ^ (parity & 0x80))
+		return tpiBreak();
+	/* recv stop bits */
+	tpiBit(1);
+	tpiBit(1);
+
+	return b;
+}
+
+static void tpiPRUpdate(uint16_t pr) {
+
+	tpi_send_byte(TPI_OP_SSTPR(0));
+	tpi_send_byte(pr);
+	tpi_send_byte(TPI_OP_SSTPR(1));
+	tpi_send_byte(pr >> 8);
+}
+
+void tpi_read_next(uint8_t* dptr, uint16_t len) {
+
+	do {
+		tpi_send_byte(TPI_OP_SLD_INC);
+		*dptr++ = tpi_recv_byte();
+	} while (--len);
+}
+
+void tpi_read_block(uint16_t addr, uint8_t* dptr, uint16_t len) {
+
+	tpiPRUpdate(addr);
+	tpi_read_next(dptr, len);
+}
+
+/* the high (odd address) byte starts the word write, BSY is polled then */
+void tpi_write_next(uint16_t addr, const uint8_t* sptr, uint16_t len) {
+	uchar low = addr;
+
+	do {
+		tpi_send_byte(TPI_OP_SST_INC);
+		tpi_send_byte(*sptr++);
+		if (low & 1) {
+			do {
+				tpi_send_byte(TPI_OP_SIN(NVMCSR));
+			} while (tpi_recv_byte() & NVMCSR_BSY);
+		}
+		low++;
+	} while (--len);
+}
+
+void tpi_write_block(uint16_t addr, const uint8_t* sptr, uint16_t len) {
+
+	tpiPRUpdate(addr);
+	/* NVMCMD <= word write */
+	tpi_send_byte(TPI_OP_SOUT(NVMCMD));
+	tpi_send_byte(NVMCMD_WORD_WRITE);
+	tpi_write_next(addr, sptr, len);
+}
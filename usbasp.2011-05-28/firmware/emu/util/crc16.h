@@ -0,0 +1,39 @@
+/*
+ * util/crc16.h - part of USBasp host side emulator
+ *
+ * Description....: CRC update functions as documented by avr-libc
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#ifndef __emu_util_crc16_h_included__
+#define	__emu_util_crc16_h_included__
+
+#include <stdint.h>
+
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data) {
+
+	data ^= crc & 0xFF;
+	data ^= data << 4;
+
+	return ((((uint16_t) data << 8) | (crc >> 8)) ^ (uint8_t) (data >> 4)
+			^ ((uint16_t) data << 3));
+}
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a) {
+
+	int i;
+
+	crc ^= a;
+	for (i = 0; i < 8; ++i) {
+		if (crc & 1)
+			crc = (crc >> 1) ^ 0xA001;
+		else
+			crc = (crc >> 1);
+	}
+
+	return crc;
+}
+
+#endif /* __emu_util_crc16_h_included__ */
@@ -10,16 +10,43 @@
  */
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
 #include "isp.h"
 #include "clock.h"
 #include "usbasp.h"
 
 #define spiHWdisable() SPCR = 0
 
-uchar sck_sw_delay;
+/* software SCK half period in timer 1 ticks (F_CPU) */
+#define SCK_SW_HALFPERIOD(hz)  ((F_CPU / 2 + (hz) / 2) / (hz))
+
+/* SCK options from fastest to slowest */
+static const uchar isp_sck_options[] PROGMEM = { USBASP_ISP_SCK_1500,
+		USBASP_ISP_SCK_750, USBASP_ISP_SCK_375, USBASP_ISP_SCK_187_5,
+		USBASP_ISP_SCK_93_75, USBASP_ISP_SCK_80, USBASP_ISP_SCK_64,
+		USBASP_ISP_SCK_50, USBASP_ISP_SCK_32, USBASP_ISP_SCK_16,
+		USBASP_ISP_SCK_8, USBASP_ISP_SCK_4, USBASP_ISP_SCK_2,
+		USBASP_ISP_SCK_1, USBASP_ISP_SCK_0_5 };
+
+unsigned int sck_sw_delay;
 uchar sck_spcr;
 uchar sck_spsr;
 uchar isp_hiaddr;
+uchar isp_pollmode = USBASP_POLL_DATA;
+
+/* state of write operation checked by ispPollWrite() */
+static unsigned long isp_poll_address;
+static uchar isp_poll_value;
+static uchar isp_poll_fixed;
+static uchar isp_poll_ticks;
+static uint8_t isp_poll_starttime;
+#if USBASP_WITH_STATS
+static unsigned long isp_poll_begin;
+#endif
+
+/* signature read by ispCheckSignature() */
+static uchar isp_signature[3];
 
 void spiHWenable() {
 	SPCR = sck_spcr;
@@ -31,10 +58,10 @@ void ispSetSCKOption(uchar option) {
 	if (option == USBASP_ISP_SCK_AUTO)
 		option = USBASP_ISP_SCK_375;
 
-	if (option >= USBASP_ISP_SCK_93_75) {
+	if ((option >= USBASP_ISP_SCK_93_75) && (option <= USBASP_ISP_SCK_1500)) {
 		ispTransmit = ispTransmit_hw;
 		sck_spsr = 0;
-		sck_sw_delay = 1;	/* force RST#/SCK pulse for 320us */
+		sck_sw_delay = F_CPU / 3125;	/* force RST#/SCK pulse for 320us */
 
 		switch (option) {
 
@@ -66,43 +93,85 @@ void ispSetSCKOption(uchar option) {
 		ispTransmit = ispTransmit_sw;
 		switch (option) {
 
+		case USBASP_ISP_SCK_80:
+			sck_sw_delay = SCK_SW_HALFPERIOD(80000);
+
+			break;
+		case USBASP_ISP_SCK_64:
+			sck_sw_delay = SCK_SW_HALFPERIOD(64000);
+
+			break;
+		case USBASP_ISP_SCK_50:
+			sck_sw_delay = SCK_SW_HALFPERIOD(50000);
+
+			break;
 		case USBASP_ISP_SCK_32:
-			sck_sw_delay = 3;
+			sck_sw_delay = SCK_SW_HALFPERIOD(32000);
 
 			break;
 		case USBASP_ISP_SCK_16:
-			sck_sw_delay = 6;
+			sck_sw_delay = SCK_SW_HALFPERIOD(16000);
 
 			break;
 		case USBASP_ISP_SCK_8:
-			sck_sw_delay = 12;
+		default:
+			sck_sw_delay = SCK_SW_HALFPERIOD(8000);
 
 			break;
 		case USBASP_ISP_SCK_4:
-			sck_sw_delay = 24;
+			sck_sw_delay = SCK_SW_HALFPERIOD(4000);
 
 			break;
 		case USBASP_ISP_SCK_2:
-			sck_sw_delay = 48;
+			sck_sw_delay = SCK_SW_HALFPERIOD(2000);
 
 			break;
 		case USBASP_ISP_SCK_1:
-			sck_sw_delay = 96;
+			sck_sw_delay = SCK_SW_HALFPERIOD(1000);
 
 			break;
 		case USBASP_ISP_SCK_0_5:
-			sck_sw_delay = 192;
+			sck_sw_delay = SCK_SW_HALFPERIOD(500);
 
 			break;
 		}
 	}
+
+	/* timer 1: CTC, no prescaler, compare match every sck_sw_delay ticks */
+	TCCR1A = 0;
+	TCCR1B = (1 << WGM12) | (1 << CS10);
+	OCR1A = sck_sw_delay - 1;
 }
 
-void ispDelay() {
+void ispSetPollMode(uchar mode) {
+	isp_pollmode = mode;
+}
+
+/* restart timer 1, next compare match is one SCK half period from now */
+static inline void ispTimerStart() {
+
+	TCNT1 = 0;
+	TIFR1 = (1 << OCF1A);
+}
 
-	uint8_t starttime = TIMERVALUE;
-	while ((uint8_t) (TIMERVALUE - starttime) < sck_sw_delay) {
+/* wait for the next compare match. the timer keeps running, so edges
+   don't depend on the code executed between two calls. if the match has
+   already passed (an interrupt ran past it), the phase gets a full half
+   period from now, phases are never shortened */
+static inline void ispTimerWait() {
+
+	if (TIFR1 & (1 << OCF1A)) {
+		ispTimerStart();
+	}
+	while (!(TIFR1 & (1 << OCF1A))) {
 	}
+	TIFR1 = (1 << OCF1A);
+}
+
+void ispDelay() {
+
+	ispTimerStart();
+	ispTimerWait();
 }
 
 void ispConnect() {
@@ -144,6 +213,8 @@ uchar ispTransmit_sw(uchar send_byte) {
 
 	uchar rec_byte = 0;
 	uchar i;
+
+	ispTimerStart();
 	for (i = 0; i < 8; i++) {
 
 		/* set MSB to MOSI-pin */
@@ -163,9 +234,9 @@ uchar ispTransmit_sw(uchar send_byte) {
 
 		/* pulse SCK */
 		ISP_OUT |= (1 << ISP_SCK); /* SCK high */
-		ispDelay();
+		ispTimerWait();
 		ISP_OUT &= ~(1 << ISP_SCK); /* SCK low */
-		ispDelay();
+		ispTimerWait();
 	}
 
 	return rec_byte;
@@ -179,9 +250,8 @@ uchar ispTransmit_hw(uchar send_byte) {
 	return SPDR;
 }
 
-uchar ispEnterProgrammingMode() {
+static uchar ispEnterProgMode(uchar count) {
 	uchar check;
-	uchar count = 32;
 
 	while (count--) {
 		ispTransmit(0xAC);
@@ -211,6 +281,156 @@ uchar ispEnterProgrammingMode() {
 	return 1; /* error: device dosn't answer */
 }
 
+uchar ispEnterProgrammingMode() {
+	return ispEnterProgMode(32);
+}
+
+static uchar ispReadSignature(uchar index) {
+	ispTransmit(0x30);
+	ispTransmit(0);
+	ispTransmit(index);
+	return ispTransmit(0);
+}
+
+/* check that the signature is an AVR one and reads back unchanged */
+static uchar ispCheckSignature() {
+	uchar sig0, sig1, sig2;
+	uchar count = 4;
+
+	sig0 = ispReadSignature(0);
+	sig1 = ispReadSignature(1);
+	sig2 = ispReadSignature(2);
+
+	if (sig0 != 0x1E) {
+		return 0;
+	}
+
+	while (count--) {
+		if ((ispReadSignature(0) != sig0) || (ispReadSignature(1) != sig1)
+				|| (ispReadSignature(2) != sig2)) {
+			return 0;
+		}
+	}
+
+	isp_signature[0] = sig0;
+	isp_signature[1] = sig1;
+	isp_signature[2] = sig2;
+
+	return 1;
+}
+
+/* connect with SCK option, returns 1 if the target answers reliably */
+static uchar ispTryOption(uchar option) {
+
+	spiHWdisable();
+	ispSetSCKOption(option);
+	ispConnect();
+
+	return (ispEnterProgMode(4) == 0) && ispCheckSignature();
+}
+
+#if USBASP_WITH_SCKCACHE
+/* EEPROM address of cache entry n */
+#define ispCacheEntry(n)  ((uint8_t *) EEPROM_SCK_CACHE + 4 * (n))
+
+/* remember option for the target in the EEPROM cache */
+static void ispCacheOption(uchar option) {
+	uchar entry[4];
+	uchar i, next;
+
+	for (i = 0; i < EEPROM_SCK_CACHE_SIZE; i++) {
+		eeprom_read_block(entry, ispCacheEntry(i), 3);
+		if ((entry[0] == isp_signature[0]) && (entry[1] == isp_signature[1])
+				&& (entry[2] == isp_signature[2])) {
+			eeprom_update_byte(ispCacheEntry(i) + 3, option);
+			return;
+		}
+	}
+
+	/* new target, replace oldest entry */
+	next = eeprom_read_byte((uint8_t *) EEPROM_SCK_CACHE_NEXT);
+	if (next >= EEPROM_SCK_CACHE_SIZE) {
+		next = 0;
+	}
+
+	entry[0] = isp_signature[0];
+	entry[1] = isp_signature[1];
+	entry[2] = isp_signature[2];
+	entry[3] = option;
+	eeprom_update_block(entry, ispCacheEntry(next), 4);
+	eeprom_update_byte((uint8_t *) EEPROM_SCK_CACHE_NEXT, (next + 1)
+			% EEPROM_SCK_CACHE_SIZE);
+}
+
+/* returns 1 if a cache entry holds option. with signature set the entry
+   must also be the connected target's */
+static uchar ispCachedOption(uchar option, uchar signature) {
+	uchar entry[4];
+	uchar i;
+
+	for (i = 0; i < EEPROM_SCK_CACHE_SIZE; i++) {
+		eeprom_read_block(entry, ispCacheEntry(i), 4);
+		if ((entry[0] == 0x1E) && (entry[3] == option) && (!signature
+				|| ((entry[1] == isp_signature[1]) && (entry[2]
+						== isp_signature[2])))) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+#else
+#define ispCacheOption(option)
+#define ispCachedOption(option, signature) 0
+#endif
+
+uchar ispConnectAuto() {
+	unsigned int failed = 0; /* bit n: option n didn't answer */
+	uchar i, option;
+
+	/* known targets: each cached option once, fastest first. once the
+	   target answers without being the cached one, slower cached options
+	   are skipped */
+	for (i = 0; i < sizeof(isp_sck_options); i++) {
+
+		option = pgm_read_byte(&isp_sck_options[i]);
+		if (!ispCachedOption(option, 0)) {
+			continue;
+		}
+
+		if (!ispTryOption(option)) {
+			failed |= 1U << option;
+			continue;
+		}
+
+		if (ispCachedOption(option, 1)) {
+			return option;
+		}
+		break;
+	}
+
+	/* try from fastest to slowest SCK */
+	for (i = 0; i < sizeof(isp_sck_options); i++) {
+
+		option = pgm_read_byte(&isp_sck_options[i]);
+		if (failed & (1U << option)) {
+			continue; /* tried above */
+		}
+
+		if (ispTryOption(option)) {
+			ispCacheOption(option);
+			return option;
+		}
+	}
+
+	/* no answer, connect with default SCK */
+	spiHWdisable();
+	ispSetSCKOption(USBASP_ISP_SCK_AUTO);
+	ispConnect();
+
+	return USBASP_ISP_SCK_AUTO;
+}
+
 static void ispUpdateExtended(unsigned long address)
 {
 	uchar curr_hiaddr;
@@ -239,6 +459,235 @@ uchar ispReadFlash(unsigned long address) {
 	return ispTransmit(0);
 }
 
+/* wait for running hardware SPI transfer, start next one and return
+   the byte received by the previous transfer */
+static inline uchar spiHWexchange(uchar send_byte) {
+	uchar rec_byte;
+
+	while (!(SPSR & (1 << SPIF)))
+		;
+	rec_byte = SPDR;
+	SPDR = send_byte;
+	return rec_byte;
+}
+
+/* wait for running hardware SPI transfer and return received byte */
+static inline uchar spiHWfinish() {
+	while (!(SPSR & (1 << SPIF)))
+		;
+	return SPDR;
+}
+
+void ispReadFlashBlock(unsigned long address, uchar *data, uchar len) {
+
+	uchar addr_hi, addr_lo, cmd;
+
+	if (len == 0)
+		return;
+
+	if (ispTransmit != ispTransmit_hw) {
+		/* software SPI: nothing to overlap */
+		do {
+			*data++ = ispReadFlash(address++);
+		} while (--len);
+		return;
+	}
+
+	ispUpdateExtended(address);
+
+	/* first command byte starts the pipeline */
+	cmd = 0x20 | ((address & 1) << 3);
+	SPDR = cmd;
+
+	for (;;) {
+		/* both bytes of a word share the same address bytes */
+		addr_hi = address >> 9;
+		addr_lo = address >> 1;
+
+		do {
+			spiHWexchange(addr_hi);
+			spiHWexchange(addr_lo);
+			spiHWexchange(0);
+
+			address++;
+			len--;
+
+			if ((len == 0) || ((unsigned int) address == 0)) {
+				/* end of block or 64k boundary: drain pipeline */
+				*data++ = spiHWfinish();
+				if (len == 0)
+					return;
+				ispUpdateExtended(address);
+				SPDR = 0x20;
+				break;
+			}
+
+			/* load next command byte while data byte is collected */
+			cmd ^= 0x08;
+			*data++ = spiHWexchange(cmd);
+
+		} while (cmd & 0x08);
+
+		cmd = 0x20;
+	}
+}
+
+void ispLoadFlashPage(unsigned long address, uchar *data, uchar len) {
+
+	unsigned int word;
+
+	if (len == 0)
+		return;
+
+	/* a page never crosses an extended address boundary */
+	ispUpdateExtended(address);
+
+	word = address >> 1;
+
+	if (ispTransmit != ispTransmit_hw) {
+		do {
+			ispTransmit(0x40 | ((address & 1) << 3));
+			ispTransmit(word >> 8);
+			ispTransmit(word);
+			ispTransmit(*data++);
+			if (address & 1)
+				word++;
+			address++;
+		} while (--len);
+		return;
+	}
+
+	/* first command byte starts the pipeline */
+	SPDR = 0x40 | ((address & 1) << 3);
+
+	for (;;) {
+		spiHWexchange(word >> 8);
+		spiHWexchange(word);
+		spiHWexchange(*data++);
+
+		if (address & 1)
+			word++;
+		address++;
+
+		if (--len == 0)
+			break;
+
+		spiHWexchange(0x40 | ((address & 1) << 3));
+	}
+
+	spiHWfinish();
+}
+
+/* prepare ispPollWrite() for a fixed delay of time * 320 us. with
+   RDY/BSY polling the delay is the upper limit */
+static void ispStartWait(uchar time) {
+
+	isp_poll_fixed = 1;
+	isp_poll_ticks = time;
+	isp_poll_starttime = TIMERVALUE;
+#if USBASP_WITH_STATS
+	isp_poll_begin = clockTicks();
+#endif
+}
+
+/* prepare ispPollWrite() for a write of data to address. busyvalue is
+   read back from flash while the target is busy */
+static void ispStartPoll(unsigned long address, uchar busyvalue, uchar data) {
+
+	isp_poll_address = address;
+	isp_poll_value = busyvalue;
+
+	if ((data == busyvalue) && (isp_pollmode == USBASP_POLL_DATA)) {
+		/* polling not possible, wait 4,8 ms */
+		ispStartWait(15);
+	} else {
+		/* polling, timeout after 9,6 ms */
+		ispStartWait(30);
+		isp_poll_fixed = 0;
+	}
+}
+
+/* Poll RDY/BSY instruction, returns 1 if target is busy */
+static uchar ispTargetBusy() {
+
+	ispTransmit(0xF0);
+	ispTransmit(0);
+	ispTransmit(0);
+	return ispTransmit(0) & 0x01;
+}
+
+uchar ispWaitReady(uchar time) {
+
+	ispStartWait(time);
+
+	while (ispTargetBusy()) {
+#if USBASP_WITH_STATS
+		clock_stats.polls++;
+#endif
+		if ((uint8_t) (TIMERVALUE - isp_poll_starttime) >= CLOCK_T_320us) {
+			isp_poll_starttime += CLOCK_T_320us;
+			if (--isp_poll_ticks == 0) {
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+uchar ispPollWrite() {
+
+	uchar result = ISP_BUSY;
+#if USBASP_WITH_STATS
+	uchar polled = 1;
+#endif
+
+	if (isp_pollmode == USBASP_POLL_RDYBSY) {
+		if (!ispTargetBusy()) {
+			result = 0;
+		}
+	} else if (isp_poll_fixed) {
+#if USBASP_WITH_STATS
+		polled = 0;
+#endif
+	} else if (ispReadFlash(isp_poll_address) != isp_poll_value) {
+		result = 0;
+	}
+
+#if USBASP_WITH_STATS
+	/* fixed delays don't count as polls */
+	if (polled && (result == ISP_BUSY)) {
+		clock_stats.polls++;
+	}
+#endif
+
+	if ((result == ISP_BUSY) && ((uint8_t) (TIMERVALUE - isp_poll_starttime)
+			>= CLOCK_T_320us)) {
+		isp_poll_starttime += CLOCK_T_320us;
+		if (--isp_poll_ticks == 0) {
+			result = isp_poll_fixed ? 0 : 1; /* timeout is an error when polling */
+		}
+	}
+
+#if USBASP_WITH_STATS
+	if (result != ISP_BUSY) {
+		clock_stats.flush += clockTicks() - isp_poll_begin;
+	}
+#endif
+
+	return result;
+}
+
+static uchar ispWaitWrite() {
+
+	uchar result;
+
+	while ((result = ispPollWrite()) == ISP_BUSY)
+		;
+
+	return result;
+}
+
 uchar ispWriteFlash(unsigned long address, uchar data, uchar pollmode) {
 
 	/* 0xFF is value after chip erase, so skip programming
@@ -257,31 +706,17 @@ uchar ispWriteFlash(unsigned long address, uchar data, uchar pollmode) {
 	if (pollmode == 0)
 		return 0;
 
-	if (data == 0x7F) {
-		clockWait(15); /* wait 4,8 ms */
-		return 0;
-	} else {
-
-		/* polling flash */
-		uchar retries = 30;
-		uint8_t starttime = TIMERVALUE;
-		while (retries != 0) {
-			if (ispReadFlash(address) != 0x7F) {
-				return 0;
-			};
-
-			if ((uint8_t) (TIMERVALUE - starttime) > CLOCK_T_320us) {
-				starttime = TIMERVALUE;
-				retries--;
-			}
+	ispStartPoll(address, 0x7F, data);
+	return ispWaitWrite();
+}
 
-		}
-		return 1; /* error */
-	}
+void ispStartWriteFlash(unsigned long address, uchar data) {
 
+	ispWriteFlash(address, data, 0);
+	ispStartPoll(address, 0x7F, data);
 }
 
-uchar ispFlushPage(unsigned long address, uchar pollvalue) {
+void ispStartFlushPage(unsigned long address, uchar pollvalue) {
 
 	ispUpdateExtended(address);
 	
@@ -290,30 +725,13 @@ uchar ispFlushPage(unsigned long address, uchar pollvalue) {
 	ispTransmit(address >> 1);
 	ispTransmit(0);
 
-	if (pollvalue == 0xFF) {
-		clockWait(15);
-		return 0;
-	} else {
-
-		/* polling flash */
-		uchar retries = 30;
-		uint8_t starttime = TIMERVALUE;
-
-		while (retries != 0) {
-			if (ispReadFlash(address) != 0xFF) {
-				return 0;
-			};
-
-			if ((uint8_t) (TIMERVALUE - starttime) > CLOCK_T_320us) {
-				starttime = TIMERVALUE;
-				retries--;
-			}
-
-		}
+	ispStartPoll(address, 0xFF, pollvalue);
+}
 
-		return 1; /* error */
-	}
+uchar ispFlushPage(unsigned long address, uchar pollvalue) {
 
+	ispStartFlushPage(address, pollvalue);
+	return ispWaitWrite();
 }
 
 uchar ispReadEEPROM(unsigned int address) {
@@ -323,14 +741,42 @@ uchar ispReadEEPROM(unsigned int address) {
 	return ispTransmit(0);
 }
 
-uchar ispWriteEEPROM(unsigned int address, uchar data) {
+void ispLoadEEPROMPage(unsigned int address, uchar data) {
+
+	ispTransmit(0xC1);
+	ispTransmit(0);
+	ispTransmit(address);
+	ispTransmit(data);
+}
+
+void ispStartFlushEEPROMPage(unsigned int address) {
+
+	ispTransmit(0xC2);
+	ispTransmit(address >> 8);
+	ispTransmit(address);
+	ispTransmit(0);
+
+	ispStartWait(30); // wait 9,6 ms
+}
+
+uchar ispFlushEEPROMPage(unsigned int address) {
+
+	ispStartFlushEEPROMPage(address);
+	return ispWaitWrite();
+}
+
+void ispStartWriteEEPROM(unsigned int address, uchar data) {
 
 	ispTransmit(0xC0);
 	ispTransmit(address >> 8);
 	ispTransmit(address);
 	ispTransmit(data);
 
-	clockWait(30); // wait 9,6 ms
+	ispStartWait(30); // wait 9,6 ms
+}
+
+uchar ispWriteEEPROM(unsigned int address, uchar data) {
 
-	return 0;
+	ispStartWriteEEPROM(address, data);
+	return ispWaitWrite();
 }
@@ -24,6 +24,12 @@
 #define ISP_MISO  PB4
 #define ISP_SCK   PB5
 
+/* ispPollWrite() result while target is busy */
+#define ISP_BUSY  0xFF
+
+/* enable hardware SPI with the current SCK option */
+void spiHWenable();
+
 /* Prepare connection to target device */
 void ispConnect();
 
@@ -47,18 +53,57 @@ uchar ispWriteFlash(unsigned long address, uchar data, uchar pollmode);
 
 uchar ispFlushPage(unsigned long address, uchar pollvalue);
 
+/* ispStart... functions issue the write like the functions above, but
+   don't wait for the target. completion is checked with ispPollWrite() */
+void ispStartWriteFlash(unsigned long address, uchar data);
+void ispStartFlushPage(unsigned long address, uchar pollvalue);
+void ispStartWriteEEPROM(unsigned int address, uchar data);
+void ispStartFlushEEPROMPage(unsigned int address);
+
+/* poll RDY/BSY until the target is ready. returns 1 on timeout after
+   time * 320 us (0 = 256) */
+uchar ispWaitReady(uchar time);
+
+/* check write started by an ispStart... function. returns ISP_BUSY while
+   the target is busy, 0 when done and 1 on timeout */
+uchar ispPollWrite();
+
 /* read byte from flash at given address */
 uchar ispReadFlash(unsigned long address);
 
+/* read len bytes from flash starting at given address. with hardware SPI
+   the instructions are pipelined back to back */
+void ispReadFlashBlock(unsigned long address, uchar *data, uchar len);
+
+/* load len bytes into the flash page buffer of the target, the bytes must
+   not cross a page. with hardware SPI the instructions are pipelined */
+void ispLoadFlashPage(unsigned long address, uchar *data, uchar len);
+
 /* write byte to eeprom at given address */
 uchar ispWriteEEPROM(unsigned int address, uchar data);
 
+/* load byte into eeprom page buffer of target */
+void ispLoadEEPROMPage(unsigned int address, uchar data);
+
+/* write eeprom page containing given address */
+uchar ispFlushEEPROMPage(unsigned int address);
+
 /* pointer to sw or hw transmit function */
 uchar (*ispTransmit)(uchar);
 
 /* set SCK speed. call before ispConnect! */
 void ispSetSCKOption(uchar sckoption);
 
+/* connect and search the fastest SCK for which the target enters
+   programming mode and reads its signature reliably. options found before
+   are cached in EEPROM by signature and tried first. returns the SCK
+   option (target left in programming mode) or USBASP_ISP_SCK_AUTO if the
+   target doesn't answer at all (connected with default SCK) */
+uchar ispConnectAuto();
+
+/* select how write completion is detected (USBASP_POLL_*) */
+void ispSetPollMode(uchar mode);
+
 /* load extended address byte */
 void ispLoadExtendedAddressByte(unsigned long address);
 
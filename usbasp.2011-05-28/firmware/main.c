@@ -10,13 +10,16 @@
  *
  * PC2 SCK speed option.
  * GND  -> slow (8khz SCK),
- * open -> software set speed (default is 375kHz SCK)
+ * open -> software set speed (default searches fastest working SCK)
  */
 
+#include <string.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
 
 #include "usbasp.h"
 #include "usbdrv.h"
@@ -24,6 +27,7 @@
 #include "clock.h"
 #include "tpi.h"
 #include "tpi_defs.h"
+#include "spiflash.h"
 
 static uchar replyBuffer[8];
 
@@ -36,26 +40,767 @@ static unsigned int prog_nbytes = 0;
 static unsigned int prog_pagesize;
 static uchar prog_blockflags;
 static uchar prog_pagecounter;
+static uchar prog_tpinext = 0;
+#if USBASP_WITH_RLE
+static uchar prog_rlestate = PROG_RLE_OFF;
+static uchar prog_rlecount;
+static uchar prog_rlevalue;
+#endif
+
+/* sparse programming: bit n of page map is set if page n (counted from
+   prog_pagemap_base) holds data. pages without data are not transferred */
+#if USBASP_WITH_SPARSE
+static uchar prog_pagemap[PROG_PAGEMAP_SIZE];
+static unsigned int prog_pagemap_len = 0;
+static unsigned long prog_pagemap_base;
+
+/* advance prog_address over pages marked empty, call at page start */
+static void progSkipPages() {
+
+	unsigned long page;
+
+	if ((prog_pagemap_len == 0) || (prog_pagesize == 0))
+		return;
+
+	while (prog_address >= prog_pagemap_base) {
+
+		page = (prog_address - prog_pagemap_base) / prog_pagesize;
+		if (page >= ((unsigned long) prog_pagemap_len << 3))
+			return;
+		if (prog_pagemap[page >> 3] & (1 << (page & 7)))
+			return;
+
+		prog_address += prog_pagesize;
+	}
+}
+#else
+#define progSkipPages()
+#endif
+
+/* little endian long from setup data (wValue, wIndex) */
+static unsigned long progLong(uchar *data) {
+
+	return ((unsigned long) data[3] << 24) | ((unsigned long) data[2] << 16)
+			| ((unsigned int) data[1] << 8) | data[0];
+}
+
+#if USBASP_WITH_STATS
+/* time spent in SPI block transfers goes to clock_stats.spi */
+static unsigned long prog_statstart;
+#define progStatStart()   prog_statstart = clockTicks()
+#define progStatSPI()     clock_stats.spi += clockTicks() - prog_statstart
+#define progStatPacket()  clock_stats.packets++
+#else
+#define progStatStart()
+#define progStatSPI()
+#define progStatPacket()
+#endif
+
+#if PROG_PAGEBUF_SIZE
+/* double buffered programming: the host fills one buffer while the data
+   in the other one is written to the target step by step from the main
+   loop. a full flash or EEPROM page (paged mode) or the bytes of one
+   packet (byte mode) are committed at once */
+static uchar prog_pagebuf[2][PROG_PAGEBUF_SIZE];
+static uchar prog_pagebuffered = 0;
+static uchar *prog_fillbuf = prog_pagebuf[0];
+static unsigned int prog_fillpos = 0;
+static unsigned long prog_filladdress;
+static uchar prog_fillmem;
+static uchar prog_fillready = 0;
+static unsigned int prog_outbytes;
+
+/* bytes of a packet received while the fill buffer was full, written by
+   progPoll() once it is committed */
+static uchar prog_spill[8];
+static uchar prog_spilllen = 0;
+
+static uchar *prog_commitbuf;
+static unsigned int prog_commitpos;
+static unsigned int prog_commitlen;
+static unsigned long prog_commitaddress;
+static uchar prog_commitmem;
+static uchar prog_commitpaged;
+static uchar prog_commitstate = PROG_COMMIT_IDLE;
+static uchar prog_hold = PROG_HOLD_OFF;
+static unsigned long prog_holdstart;
+
+/* written data is still going to the target */
+#define progBusy()   (prog_fillready || (prog_commitstate != PROG_COMMIT_IDLE))
+#define progFull()   prog_fillready
+
+static uchar progWriteData(uchar *data, uchar len);
+
+/* do one step of writing the committed buffer to the target */
+static void progCommitStep() {
+
+	unsigned long address;
+	uchar n;
+
+	if (prog_commitstate == PROG_COMMIT_LOAD) {
+
+		address = prog_commitaddress + prog_commitpos;
+
+		if (!prog_commitpaged) {
+
+			/* byte mode: write one byte, then wait for it */
+			if (prog_commitmem == PROG_STATE_WRITEFLASH) {
+				ispStartWriteFlash(address, prog_commitbuf[prog_commitpos]);
+			} else {
+				ispStartWriteEEPROM(address, prog_commitbuf[prog_commitpos]);
+			}
+			prog_commitpos++;
+			prog_commitstate = PROG_COMMIT_FLUSH;
+			return;
+		}
+
+		/* load at most one packet per step to keep usbPoll() going,
+		   software SCK is slow enough to go byte by byte */
+		n = 8;
+		if (ispTransmit == ispTransmit_sw)
+			n = 1;
+		if (prog_commitlen - prog_commitpos < n)
+			n = prog_commitlen - prog_commitpos;
+
+		progStatStart();
+		if (prog_commitmem == PROG_STATE_WRITEFLASH) {
+			ispLoadFlashPage(address, prog_commitbuf + prog_commitpos, n);
+			address += n;
+			prog_commitpos += n;
+		} else {
+			while (n--) {
+				ispLoadEEPROMPage(address, prog_commitbuf[prog_commitpos]);
+				address++;
+				prog_commitpos++;
+			}
+		}
+		progStatSPI();
+
+		if (prog_commitpos == prog_commitlen) {
+			address--;
+			if (prog_commitmem == PROG_STATE_WRITEFLASH) {
+				ispStartFlushPage(address, prog_commitbuf[prog_commitlen - 1]);
+			} else {
+				ispStartFlushEEPROMPage(address);
+			}
+			prog_commitstate = PROG_COMMIT_FLUSH;
+		}
+
+	} else if (prog_commitstate == PROG_COMMIT_FLUSH) {
+
+		if (ispPollWrite() != ISP_BUSY) {
+			if (prog_commitpos == prog_commitlen) {
+				prog_commitstate = PROG_COMMIT_IDLE;
+			} else {
+				prog_commitstate = PROG_COMMIT_LOAD;
+			}
+		}
+	}
+}
+
+/* hand fill buffer over to target and switch to other buffer, the
+   previous commit must be done */
+static void progCommitPage() {
+
+#if USBASP_WITH_SPARSE
+	if (prog_pagemap_len && prog_pagesize && (prog_fillmem
+			== PROG_STATE_WRITEFLASH)) {
+		/* sparse mode: target is erased, nothing to do for blank pages */
+		unsigned int i;
+
+		for (i = 0; i < prog_fillpos; i++) {
+			if (prog_fillbuf[i] != 0xFF)
+				break;
+		}
+		if (i == prog_fillpos) {
+			prog_fillpos = 0;
+			return;
+		}
+	}
+#endif
+
+	prog_commitbuf = prog_fillbuf;
+	prog_commitaddress = prog_filladdress;
+	prog_commitlen = prog_fillpos;
+	prog_commitpos = 0;
+	prog_commitmem = prog_fillmem;
+	prog_commitpaged = (prog_pagesize != 0);
+	prog_commitstate = PROG_COMMIT_LOAD;
+
+	if (prog_fillbuf == prog_pagebuf[0]) {
+		prog_fillbuf = prog_pagebuf[1];
+	} else {
+		prog_fillbuf = prog_pagebuf[0];
+	}
+	prog_fillpos = 0;
+}
+
+/* commit fill buffer. if the target is still busy, the buffer is full
+   until the main loop commits it. the firmware never waits for the
+   target in a USB callback */
+static void progCommitFill() {
+
+	if (prog_commitstate != PROG_COMMIT_IDLE) {
+		prog_fillready = 1;
+		return;
+	}
+
+	progCommitPage();
+}
+
+/* returns 1 once the target caught up as required by prog_hold */
+static uchar progHoldDone() {
+
+	if (prog_hold == PROG_HOLD_FILL)
+		return !prog_fillready;
+
+	return !progBusy();
+}
+
+/* end of a write request: the next request is NAKed until the target
+   caught up. after the last block (or in byte mode) the data must be
+   written, else the fill buffer must be free again */
+static void progHold() {
+
+	if ((prog_blockflags & PROG_BLOCKFLAG_LAST) || (prog_pagesize == 0)) {
+		prog_hold = PROG_HOLD_IDLE;
+	} else {
+		prog_hold = PROG_HOLD_FILL;
+	}
+
+	if (progHoldDone()) {
+		prog_hold = PROG_HOLD_OFF;
+		return;
+	}
+
+	/* a hold following the fill hold keeps its start */
+	if (!usbAllRequestsAreDisabled()) {
+		prog_holdstart = clockTicks();
+		usbDisableAllRequests();
+	}
+}
+
+/* fill buffer full within a request: further data is NAKed until the
+   main loop committed it */
+static void progHoldFill() {
+
+	prog_hold = PROG_HOLD_FILL;
+	prog_holdstart = clockTicks();
+	usbDisableAllRequests();
+}
+
+/* background work, called from main loop */
+static void progPoll() {
+
+	progCommitStep();
+
+	if (prog_fillready && (prog_commitstate == PROG_COMMIT_IDLE)) {
+		progCommitPage();
+		prog_fillready = 0;
+		/* the rest of the packet may fill the buffer again or end the
+		   request */
+		if (progWriteData(prog_spill, prog_spilllen)) {
+			progHold();
+		}
+		if (!prog_hold && usbAllRequestsAreDisabled())
+			usbEnableAllRequests();
+	}
+
+	/* the hold is limited, with slow SCK a page takes seconds. the host
+	   polls GETSTATUS then, requests using the target are refused and
+	   data received while the fill buffer is full is stalled */
+	if (prog_hold && (progHoldDone() || (clockTicks() - prog_holdstart
+			> PROG_HOLD_TICKS))) {
+		prog_hold = PROG_HOLD_OFF;
+		usbEnableAllRequests();
+	}
+}
+#else
+#define progPoll()
+#define progBusy()   0
+#define progFull()   0
+#endif
+
+/* returns 1 for requests that access the target. the others are answered
+   while written data is still going to it */
+static uchar progTargetRequest(uchar request) {
+
+	return (request != USBASP_FUNC_GETSTATUS) && (request
+			!= USBASP_FUNC_GETCAPABILITIES) && (request
+			!= USBASP_FUNC_GETSTATS) && (request != USBASP_FUNC_SETISPSCK)
+			&& (request != USBASP_FUNC_SETPOLLMODE) && (request
+			!= USBASP_FUNC_SETLONGADDRESS);
+}
+
+/* raw SPI block transfer: MISO bytes are kept for the IN request. the
+   page buffers are free whenever a request is processed */
+#if PROG_PAGEBUF_SIZE
+#define prog_transferbuf        ((uchar *) prog_pagebuf)
+#define PROG_TRANSFER_SIZE      (2 * PROG_PAGEBUF_SIZE)
+#else
+#define prog_transferbuf        replyBuffer
+#define PROG_TRANSFER_SIZE      sizeof(replyBuffer)
+#endif
+static unsigned int prog_transferlen = 0;
+static uchar *prog_resultbuf = prog_transferbuf;
+
+/* script in the lower half of the transfer buffer, results in the upper */
+#define PROG_SCRIPT_SIZE        (PROG_TRANSFER_SIZE / 2)
+
+/* smallest useful script: one SPI op, reported only if it fits */
+#define PROG_SCRIPT_MIN         5
+
+#define progTransferRequest(request) ((USBASP_WITH_TRANSMITBLOCK \
+		&& ((request) == USBASP_FUNC_TRANSMITBLOCK)) || (USBASP_WITH_SCRIPT \
+		&& ((request) == USBASP_FUNC_SCRIPT)))
+
+#if USBASP_WITH_SCRIPT
+/* run script of len bytes, results are returned like TRANSMITBLOCK data */
+static void progRunScript(unsigned int len) {
+
+	uchar *script = prog_transferbuf;
+	uchar *result = prog_transferbuf + PROG_SCRIPT_SIZE;
+	unsigned int pc = 0;
+	unsigned int resultlen = 1;
+	uchar status = USBASP_SCRIPT_OK;
+	uchar last = 0;
+	uchar op, oplen;
+
+	while ((pc < len) && (status == USBASP_SCRIPT_OK)) {
+
+		op = script[pc];
+		if (op == USBASP_SCRIPT_END) {
+			break;
+		}
+
+		if ((op == USBASP_SCRIPT_SPI) || (op == USBASP_SCRIPT_SPI_READ) || (op
+				== USBASP_SCRIPT_RETRY)) {
+			oplen = 5;
+		} else if ((op == USBASP_SCRIPT_WAIT) || (op
+				== USBASP_SCRIPT_WAIT_READY)) {
+			oplen = 2;
+		} else {
+			oplen = 1;
+		}
+		if (pc + oplen > len) {
+			status = USBASP_SCRIPT_INVALID;
+			break;
+		}
+
+		if ((op == USBASP_SCRIPT_SPI) || (op == USBASP_SCRIPT_SPI_READ)) {
+			ispTransmit(script[pc + 1]);
+			ispTransmit(script[pc + 2]);
+			ispTransmit(script[pc + 3]);
+			last = ispTransmit(script[pc + 4]);
+			if ((op == USBASP_SCRIPT_SPI_READ) && (resultlen
+					< PROG_SCRIPT_SIZE)) {
+				result[resultlen++] = last;
+			}
+		} else if (op == USBASP_SCRIPT_WAIT) {
+			clockWait(script[pc + 1]);
+		} else if (op == USBASP_SCRIPT_WAIT_READY) {
+			if (ispWaitReady(script[pc + 1])) {
+				status = USBASP_SCRIPT_FAILED;
+			}
+		} else if (op == USBASP_SCRIPT_ENTERPROG) {
+			if (ispEnterProgrammingMode()) {
+				status = USBASP_SCRIPT_FAILED;
+			}
+		} else if (op == USBASP_SCRIPT_RETRY) {
+			if ((last & script[pc + 1]) != script[pc + 2]) {
+				if (script[pc + 4] > pc) {
+					status = USBASP_SCRIPT_INVALID;
+				} else if (script[pc + 3] == 0) {
+					status = USBASP_SCRIPT_FAILED;
+				} else {
+					/* retry counter lives in the script itself */
+					script[pc + 3]--;
+					pc -= script[pc + 4];
+					continue;
+				}
+			}
+		} else {
+			status = USBASP_SCRIPT_INVALID;
+		}
+
+		pc += oplen;
+	}
+
+	result[0] = status;
+	prog_resultbuf = result;
+	prog_transferlen = resultlen;
+}
+#endif
+
+/* read ahead ring of 8 byte packets for READFLASH/READEEPROM and STREAM,
+   filled from the main loop between packets. slot counters wrap, slot n
+   is prog_ring[n & (PROG_RING_SLOTS - 1)] */
+static uchar prog_ring[PROG_RING_SLOTS][8];
+static uchar prog_ringlen[PROG_RING_SLOTS];
+static uchar prog_ringhead = 0;
+static uchar prog_ringtail = 0;
+static uchar prog_ringmem;
+static uchar prog_ringstream = 0;
+static unsigned long prog_ringaddress;
+static unsigned int prog_ringremain = 0;
+
+/* start reading nbytes of memory (PROG_STATE_READFLASH/READEEPROM) at
+   address into the ring, drops what is left in it */
+static void progRingStart(uchar mem, unsigned long address,
+		unsigned int nbytes) {
+
+	prog_ringhead = prog_ringtail = 0;
+	prog_ringmem = mem;
+	prog_ringstream = 0;
+	prog_ringaddress = address;
+	prog_ringremain = nbytes;
+}
+
+/* drop read ahead data, no more target access from the main loop */
+static void progRingStop() {
+
+	prog_ringhead = prog_ringtail = 0;
+	prog_ringremain = 0;
+}
+
+/* read next packet into the ring if there is room */
+static void progRingFill() {
+
+	uchar *slot;
+	uchar i, n;
+
+	if ((prog_ringremain == 0) || ((uchar) (prog_ringhead - prog_ringtail)
+			>= PROG_RING_SLOTS)) {
+		return;
+	}
+
+	n = (prog_ringremain > 8) ? 8 : prog_ringremain;
+	slot = prog_ring[prog_ringhead & (PROG_RING_SLOTS - 1)];
+
+	progStatStart();
+	if (prog_ringmem == PROG_STATE_READFLASH) {
+		ispReadFlashBlock(prog_ringaddress, slot, n);
+	} else {
+		for (i = 0; i < n; i++) {
+			slot[i] = ispReadEEPROM(prog_ringaddress + i);
+		}
+	}
+	progStatSPI();
+
+	prog_ringlen[prog_ringhead & (PROG_RING_SLOTS - 1)] = n;
+	prog_ringaddress += n;
+	prog_ringremain -= n;
+	prog_ringhead++;
+}
+
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+/* STREAM: send ring packets on the interrupt IN endpoint. the next packet
+   is read while the current one waits for the host's IN token */
+static void progStream() {
+
+	uchar slot;
+
+	if (prog_ringstream && (prog_ringhead != prog_ringtail)
+			&& usbInterruptIsReady()) {
+		slot = prog_ringtail & (PROG_RING_SLOTS - 1);
+		usbSetInterrupt(prog_ring[slot], prog_ringlen[slot]);
+		prog_ringtail++;
+	}
+}
+#else
+#define progStream()
+#endif
+
+#if USBASP_WITH_TPI_AUTOCLOCK
+/* returns 1 if TPIIR reads back correctly several times in a row */
+static uchar progTPICheck() {
+
+	uchar i;
+
+	for (i = 0; i < 8; i++) {
+		/* tpi_recv_byte() sends a break on parity/frame errors */
+		tpi_send_byte(TPI_OP_SLDCS(TPIIR));
+		if (tpi_recv_byte() != TPIIR_ID)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* search the smallest tpi_dly_cnt up to maxdelay for which progTPICheck()
+   passes. the last working delay is kept in EEPROM and tried first.
+   returns 0 on success, 1 if the target doesn't answer (tpi_dly_cnt is
+   left at maxdelay) */
+static uchar progTPICalibrate(uint16_t maxdelay) {
+
+	tpi_dly_cnt = eeprom_read_word((uint16_t *) EEPROM_TPI_DELAY);
+	if ((tpi_dly_cnt <= maxdelay) && progTPICheck())
+		return 0;
+
+	tpi_dly_cnt = 0;
+
+	for (;;) {
+		if (progTPICheck()) {
+			eeprom_update_word((uint16_t *) EEPROM_TPI_DELAY, tpi_dly_cnt);
+			return 0;
+		}
+
+		if (tpi_dly_cnt >= maxdelay)
+			return 1;
+
+		/* halve the clock */
+		tpi_dly_cnt = (tpi_dly_cnt << 1) + 1;
+		if (tpi_dly_cnt > maxdelay)
+			tpi_dly_cnt = maxdelay;
+	}
+}
+#endif
+
+/* prepare WRITEFLASH/WRITEEEPROM for prog_state and prog_pagesize.
+   returns 1 if the data can't be taken before the target caught up */
+static uchar progStartWrite() {
+
+#if !USBASP_WITH_RLE
+	if (prog_blockflags & PROG_BLOCKFLAG_RLE)
+		return 1; /* not built */
+#endif
+
+#if PROG_PAGEBUF_SIZE
+	prog_pagebuffered = (prog_pagesize <= PROG_PAGEBUF_SIZE);
+
+	if (prog_pagebuffered ? prog_fillready : progBusy())
+		return 1;
+
+	/* a page may continue over several requests */
+	if ((prog_blockflags & PROG_BLOCKFLAG_FIRST) || (prog_pagesize == 0)
+			|| (prog_fillmem != prog_state)) {
+		prog_fillpos = 0;
+	}
+	prog_fillmem = prog_state;
+#endif
+
+	return 0;
+}
+
+/* GETCRC, BLANKCHECK and PAGEHASH read the target step by step from the
+   main loop. the request starts the check and gets no data, the host
+   repeats it once GETSTATUS doesn't report USBASP_STATUS_CHECK anymore
+   and gets the result. other requests using the target cancel it */
+#if USBASP_WITH_CHECK
+#if PROG_PAGEBUF_SIZE
+#define prog_checkbuf           ((uchar *) prog_pagebuf)
+#define PROG_CHECK_SIZE         ((2 * PROG_PAGEBUF_SIZE > 254) ? 254 \
+		: 2 * PROG_PAGEBUF_SIZE)
+#else
+static uchar prog_checkbuf[8];
+#define PROG_CHECK_SIZE         sizeof(prog_checkbuf)
+#endif
+static uchar prog_check = PROG_CHECK_IDLE;
+static uchar prog_checksetup[7];
+static uchar prog_checkoptions;
+static uchar prog_checklen;
+static unsigned long prog_checkstart;
+static unsigned long prog_checkaddress;
+static unsigned int prog_checkleft;
+static unsigned int prog_checkpages;
+static unsigned int prog_checkcrc16;
+#if USBASP_WITH_CRC32
+static unsigned long prog_checkcrc32;
+#endif
+
+/* returns 1 if setup data repeats the check request */
+static uchar progCheckRequest(uchar *data) {
+
+	return (prog_check != PROG_CHECK_IDLE) && (prog_address
+			== prog_checkstart) && !memcmp(prog_checksetup, data + 1, 7);
+}
+
+/* start check of nbytes at prog_address (or pages of nbytes each) */
+static void progCheckStart(uchar *data, uchar options, unsigned int nbytes,
+		unsigned int pages) {
+
+	memcpy(prog_checksetup, data + 1, 7);
+	prog_checkoptions = options;
+	prog_checkstart = prog_address;
+	prog_checkaddress = prog_address;
+	prog_checkleft = nbytes;
+	prog_checkpages = pages;
+	prog_checklen = 0;
+	prog_checkcrc16 = 0xFFFF;
+#if USBASP_WITH_CRC32
+	prog_checkcrc32 = 0xFFFFFFFF;
+#endif
+	prog_check = PROG_CHECK_RUNNING;
+}
+
+/* result of the finished check */
+static void progCheckDone(uchar len) {
+
+	prog_checklen = len;
+	prog_check = PROG_CHECK_DONE;
+}
+
+/* read the next bytes of a running check */
+static void progCheckStep() {
+
+	uchar buffer[8];
+	uchar n, i;
+#if USBASP_WITH_CRC32
+	uchar j;
+#endif
+
+	if (prog_check != PROG_CHECK_RUNNING)
+		return;
+
+	/* software SCK is slow enough to go byte by byte */
+	n = 8;
+	if (ispTransmit == ispTransmit_sw)
+		n = 1;
+	if (prog_checkleft < n)
+		n = prog_checkleft;
+
+	progStatStart();
+	if (prog_checkoptions & USBASP_CRC_EEPROM) {
+		for (i = 0; i < n; i++) {
+			buffer[i] = ispReadEEPROM(prog_checkaddress + i);
+		}
+	} else {
+		ispReadFlashBlock(prog_checkaddress, buffer, n);
+	}
+	progStatSPI();
+
+	for (i = 0; i < n; i++) {
+		if (prog_checksetup[0] == USBASP_FUNC_BLANKCHECK) {
+			if (buffer[i] != 0xFF) {
+				prog_checkleft = 0;
+				break;
+			}
+			continue;
+		}
+#if USBASP_WITH_CRC32
+		if (prog_checkoptions & USBASP_CRC_32) {
+			prog_checkcrc32 ^= buffer[i];
+			for (j = 0; j < 8; j++) {
+				if (prog_checkcrc32 & 1) {
+					prog_checkcrc32 = (prog_checkcrc32 >> 1) ^ 0xEDB88320;
+				} else {
+					prog_checkcrc32 >>= 1;
+				}
+			}
+			continue;
+		}
+#endif
+		prog_checkcrc16 = _crc_ccitt_update(prog_checkcrc16, buffer[i]);
+	}
+	prog_checkaddress += i;
+	if (prog_checkleft)
+		prog_checkleft -= i;
+
+	if (prog_checkleft)
+		return;
+
+	if (prog_checksetup[0] == USBASP_FUNC_BLANKCHECK) {
+		/* status and first non blank (or end) address */
+		prog_checkbuf[0] = (i < n) ? USBASP_NOT_BLANK : USBASP_BLANK;
+		prog_checkbuf[1] = prog_checkaddress;
+		prog_checkbuf[2] = prog_checkaddress >> 8;
+		prog_checkbuf[3] = prog_checkaddress >> 16;
+		prog_checkbuf[4] = prog_checkaddress >> 24;
+		progCheckDone(5);
+		return;
+	}
+
+#if USBASP_WITH_CRC32
+	if (prog_checkoptions & USBASP_CRC_32) {
+		prog_checkcrc32 = ~prog_checkcrc32;
+		prog_checkbuf[0] = prog_checkcrc32;
+		prog_checkbuf[1] = prog_checkcrc32 >> 8;
+		prog_checkbuf[2] = prog_checkcrc32 >> 16;
+		prog_checkbuf[3] = prog_checkcrc32 >> 24;
+		progCheckDone(4);
+		return;
+	}
+#endif
+
+	/* GETCRC, or the hash of one more page for PAGEHASH */
+	prog_checkbuf[prog_checklen++] = prog_checkcrc16;
+	prog_checkbuf[prog_checklen++] = prog_checkcrc16 >> 8;
+	prog_checkcrc16 = 0xFFFF;
+	if (prog_checkpages > 1) {
+		prog_checkpages--;
+		prog_checkleft = (prog_checksetup[4] << 8) | prog_checksetup[3];
+		return;
+	}
+	progCheckDone(prog_checklen);
+}
+#else
+#define progCheckStep()
+#endif
 
 uchar usbFunctionSetup(uchar data[8]) {
 
 	uchar len = 0;
+	unsigned int offset;
+
+	usbMsgPtr = replyBuffer;
+	progStatPacket();
+
+	/* written data may still be going to the target (see progHold()).
+	   requests using it are stalled until GETSTATUS reports it idle,
+	   writes decide in progStartWrite(). while the fill buffer is full
+	   the written bytes are pending, the write state is kept until
+	   GETSTATUS reports it not full */
+	if ((progBusy() && progTargetRequest(data[1]) && (data[1]
+			!= USBASP_FUNC_WRITEFLASH) && (data[1] != USBASP_FUNC_WRITEEEPROM))
+			|| (progFull() && (progTargetRequest(data[1]) || (data[1]
+					== USBASP_FUNC_SETLONGADDRESS)))) {
+		prog_state = PROG_STATE_IDLE;
+		return 0xff;
+	}
+
+	/* read ahead (or streaming) ends with the next request */
+	progRingStop();
+
+#if USBASP_WITH_CHECK
+	/* a check runs until its request is repeated */
+	if (progTargetRequest(data[1]) && !progCheckRequest(data)) {
+		prog_check = PROG_CHECK_IDLE;
+	}
+#endif
+
+#if USBASP_WITH_SPIFLASH
+	/* SPI flash reads and page programs may continue over requests */
+	if ((data[1] != USBASP_FUNC_SPIFLASH_READ) && (data[1]
+			!= USBASP_FUNC_SPIFLASH_WRITE)) {
+		spiflashEnd();
+	}
+#endif
 
 	if (data[1] == USBASP_FUNC_CONNECT) {
 
-		/* set SCK speed */
+		/* set compatibility mode of address delivering */
+		prog_address_newmode = 0;
+
+#if USBASP_WITH_SPARSE
+		/* no sparse programming */
+		prog_pagemap_len = 0;
+#endif
+
+		ledRedOn();
+
+		/* set SCK speed and connect */
 		if ((PINC & (1 << 0)) == 0) {
 			ispSetSCKOption(USBASP_ISP_SCK_8);
+			ispConnect();
+		} else if (prog_sck == USBASP_ISP_SCK_AUTO) {
+			/* search fastest SCK and report it */
+			replyBuffer[0] = ispConnectAuto();
+			len = 1;
 		} else {
 			ispSetSCKOption(prog_sck);
+			ispConnect();
 		}
 
-		/* set compatibility mode of address delivering */
-		prog_address_newmode = 0;
-
-		ledRedOn();
-		ispConnect();
-
 	} else if (data[1] == USBASP_FUNC_DISCONNECT) {
 		ispDisconnect();
 		ledRedOff();
@@ -74,6 +819,8 @@ uchar usbFunctionSetup(uchar data[8]) {
 
 		prog_nbytes = (data[7] << 8) | data[6];
 		prog_state = PROG_STATE_READFLASH;
+		/* V-USB reads up to the low byte of wLength */
+		progRingStart(PROG_STATE_READFLASH, prog_address, data[6]);
 		len = 0xff; /* multiple in */
 
 	} else if (data[1] == USBASP_FUNC_READEEPROM) {
@@ -83,6 +830,7 @@ uchar usbFunctionSetup(uchar data[8]) {
 
 		prog_nbytes = (data[7] << 8) | data[6];
 		prog_state = PROG_STATE_READEEPROM;
+		progRingStart(PROG_STATE_READEEPROM, prog_address, data[6]);
 		len = 0xff; /* multiple in */
 
 	} else if (data[1] == USBASP_FUNC_ENABLEPROG) {
@@ -102,6 +850,17 @@ uchar usbFunctionSetup(uchar data[8]) {
 		}
 		prog_nbytes = (data[7] << 8) | data[6];
 		prog_state = PROG_STATE_WRITEFLASH;
+#if PROG_PAGEBUF_SIZE
+		prog_outbytes = prog_nbytes;
+#endif
+#if USBASP_WITH_RLE
+		prog_rlestate = (prog_blockflags & PROG_BLOCKFLAG_RLE)
+				? PROG_RLE_LENGTH_LO : PROG_RLE_OFF;
+#endif
+		if (progStartWrite()) {
+			/* refused, usbFunctionWrite() stalls */
+			prog_state = PROG_STATE_IDLE;
+		}
 		len = 0xff; /* multiple out */
 
 	} else if (data[1] == USBASP_FUNC_WRITEEEPROM) {
@@ -109,10 +868,30 @@ uchar usbFunctionSetup(uchar data[8]) {
 		if (!prog_address_newmode)
 			prog_address = (data[3] << 8) | data[2];
 
-		prog_pagesize = 0;
-		prog_blockflags = 0;
+		prog_pagesize = data[4];
+		prog_blockflags = data[5] & 0x0F;
+		prog_pagesize += (((unsigned int) data[5] & 0xF0) << 4);
+#if USBASP_WITH_RLE
+		prog_rlestate = (prog_blockflags & PROG_BLOCKFLAG_RLE)
+				? PROG_RLE_LENGTH_LO : PROG_RLE_OFF;
+#endif
+		if (!(prog_blockflags & PROG_BLOCKFLAG_PAGED)) {
+			/* byte mode, page size sent by older hosts is ignored */
+			prog_pagesize = 0;
+			prog_blockflags = 0;
+		}
+		if (prog_blockflags & PROG_BLOCKFLAG_FIRST) {
+			prog_pagecounter = prog_pagesize;
+		}
 		prog_nbytes = (data[7] << 8) | data[6];
 		prog_state = PROG_STATE_WRITEEEPROM;
+#if PROG_PAGEBUF_SIZE
+		prog_outbytes = prog_nbytes;
+#endif
+		if (progStartWrite()) {
+			/* refused, usbFunctionWrite() stalls */
+			prog_state = PROG_STATE_IDLE;
+		}
 		len = 0xff; /* multiple out */
 
 	} else if (data[1] == USBASP_FUNC_SETLONGADDRESS) {
@@ -120,7 +899,7 @@ uchar usbFunctionSetup(uchar data[8]) {
 		/* set new mode of address delivering (ignore address delivered in commands) */
 		prog_address_newmode = 1;
 		/* set new address */
-		prog_address = *((unsigned long*) &data[2]);
+		prog_address = progLong(&data[2]);
 
 	} else if (data[1] == USBASP_FUNC_SETISPSCK) {
 
@@ -129,6 +908,13 @@ uchar usbFunctionSetup(uchar data[8]) {
 		replyBuffer[0] = 0;
 		len = 1;
 
+	} else if (data[1] == USBASP_FUNC_SETPOLLMODE) {
+
+		/* set write completion detection */
+		ispSetPollMode(data[2]);
+		replyBuffer[0] = 0;
+		len = 1;
+
 	} else if (data[1] == USBASP_FUNC_TPI_CONNECT) {
 		tpi_dly_cnt = data[2] | (data[3] << 8);
 
@@ -144,6 +930,16 @@ uchar usbFunctionSetup(uchar data[8]) {
 
 		clockWait(16);
 		tpi_init();
+
+#if USBASP_WITH_TPI_AUTOCLOCK
+		if (data[4] & USBASP_TPI_AUTOCLOCK) {
+			/* report chosen delay and status */
+			replyBuffer[2] = progTPICalibrate(data[2] | (data[3] << 8));
+			replyBuffer[0] = tpi_dly_cnt;
+			replyBuffer[1] = tpi_dly_cnt >> 8;
+			len = 3;
+		}
+#endif
 	
 	} else if (data[1] == USBASP_FUNC_TPI_DISCONNECT) {
 
@@ -176,54 +972,341 @@ uchar usbFunctionSetup(uchar data[8]) {
 		prog_address = (data[3] << 8) | data[2];
 		prog_nbytes = (data[7] << 8) | data[6];
 		prog_state = PROG_STATE_TPI_READ;
+		/* V-USB reads up to the low byte of wLength, max. 254 bytes.
+		   PR is set with the first packet only */
+		prog_tpinext = 0;
 		len = 0xff; /* multiple in */
 	
 	} else if (data[1] == USBASP_FUNC_TPI_WRITEBLOCK) {
 		prog_address = (data[3] << 8) | data[2];
 		prog_nbytes = (data[7] << 8) | data[6];
 		prog_state = PROG_STATE_TPI_WRITE;
+		/* PR and NVMCMD are set with the first packet only */
+		prog_tpinext = 0;
 		len = 0xff; /* multiple out */
 	
+#if USBASP_WITH_CHECK
+	} else if (progCheckRequest(data)) {
+
+		/* repeated GETCRC, BLANKCHECK or PAGEHASH: no data until done */
+		if (prog_check == PROG_CHECK_DONE) {
+			prog_check = PROG_CHECK_IDLE;
+			prog_address = prog_checkaddress;
+			usbMsgPtr = prog_checkbuf;
+			len = prog_checklen;
+		}
+
+	} else if (data[1] == USBASP_FUNC_GETCRC) {
+
+		/* wIndex is the range length, wLength the CRC size. options are
+		   in the wValue high byte with the long address */
+		uchar options = 0;
+
+		if (prog_address_newmode) {
+			options = data[3];
+		} else {
+			prog_address = (data[3] << 8) | data[2];
+		}
+
+#if !USBASP_WITH_CRC32
+		if (options & USBASP_CRC_32) {
+			/* not built, usbFunctionRead() stalls */
+			prog_state = PROG_STATE_IDLE;
+			return 0xff;
+		}
+#endif
+		progCheckStart(data, options, (data[5] << 8) | data[4], 1);
+
+	} else if (data[1] == USBASP_FUNC_BLANKCHECK) {
+
+		/* wIndex is the range length */
+		if (!prog_address_newmode)
+			prog_address = (data[3] << 8) | data[2];
+
+		progCheckStart(data, 0, (data[5] << 8) | data[4], 1);
+
+#endif
+#if USBASP_WITH_SPARSE
+	} else if (data[1] == USBASP_FUNC_SETPAGEMAP) {
+
+		/* map length 0 ends sparse programming. maps longer than
+		   PROG_PAGEMAP_SIZE (see GETCAPABILITIES) are stalled, the host
+		   has to write densely */
+		prog_pagemap_base = progLong(&data[2]);
+		prog_nbytes = (data[7] << 8) | data[6];
+		prog_pagemap_len = 0;
+		if (prog_nbytes > PROG_PAGEMAP_SIZE) {
+			/* refused, usbFunctionWrite() stalls */
+			prog_state = PROG_STATE_IDLE;
+			len = 0xff;
+		} else if (prog_nbytes != 0) {
+			prog_state = PROG_STATE_SETPAGEMAP;
+			len = 0xff; /* multiple out */
+		}
+
+#endif
+	} else if (progTransferRequest(data[1]) && (data[0]
+			& USBRQ_DIR_DEVICE_TO_HOST)) {
+
+		/* return received bytes or script results starting at offset */
+		offset = (data[3] << 8) | data[2];
+		if (offset < prog_transferlen) {
+			usbMsgPtr = prog_resultbuf + offset;
+			offset = prog_transferlen - offset;
+			len = (offset > 254) ? 254 : offset;
+		}
+
+	} else if (progTransferRequest(data[1])) {
+
+		/* send data stage to target or receive script, too long transfers
+		   are ignored */
+		prog_nbytes = (data[7] << 8) | data[6];
+		prog_transferlen = 0;
+		prog_resultbuf = prog_transferbuf;
+		if ((prog_nbytes != 0) && (prog_nbytes <= ((data[1]
+				== USBASP_FUNC_SCRIPT) ? PROG_SCRIPT_SIZE : PROG_TRANSFER_SIZE))) {
+#if PROG_PAGEBUF_SIZE
+			prog_fillpos = 0;
+#endif
+			prog_state = (data[1] == USBASP_FUNC_SCRIPT) ? PROG_STATE_SCRIPT
+					: PROG_STATE_TRANSMIT;
+			len = 0xff; /* multiple out */
+		}
+
+#if USBASP_WITH_SPIFLASH
+	} else if (data[1] == USBASP_FUNC_SPIFLASH_CONNECT) {
+
+		/* SPI flash is fast, AUTO uses the fastest SCK */
+		if (prog_sck == USBASP_ISP_SCK_AUTO) {
+			ispSetSCKOption(USBASP_ISP_SCK_1500);
+		} else {
+			ispSetSCKOption(prog_sck);
+		}
+		spiflashConnect();
+		ledRedOn();
+
+	} else if (data[1] == USBASP_FUNC_SPIFLASH_ID) {
+		spiflashReadID(replyBuffer);
+		len = 3;
+
+	} else if (data[1] == USBASP_FUNC_SPIFLASH_STATUS) {
+		replyBuffer[0] = spiflashReadStatus();
+		len = 1;
+
+	} else if (data[1] == USBASP_FUNC_SPIFLASH_ERASE) {
+
+		/* sector, block or chip erase at long address. the host polls
+		   SPIFLASH_STATUS until WIP is cleared */
+		if ((data[2] == SPIFLASH_CMD_SE) || (data[2] == SPIFLASH_CMD_BE)
+				|| (data[2] == SPIFLASH_CMD_CE)) {
+			spiflashErase(data[2], prog_address);
+		}
+
+	} else if (data[1] == USBASP_FUNC_SPIFLASH_READ) {
+
+		/* SPI flash always uses the long address */
+		prog_nbytes = (data[7] << 8) | data[6];
+		prog_state = PROG_STATE_SPIFLASH_READ;
+		len = 0xff; /* multiple in */
+
+	} else if (data[1] == USBASP_FUNC_SPIFLASH_WRITE) {
+
+		prog_nbytes = (data[7] << 8) | data[6];
+		if (prog_nbytes != 0) {
+			prog_state = PROG_STATE_SPIFLASH_WRITE;
+			len = 0xff; /* multiple out */
+		}
+
+#endif
+	} else if (data[1] == USBASP_FUNC_GETSTATUS) {
+
+		replyBuffer[0] = progBusy() ? USBASP_STATUS_BUSY : 0;
+		if (progFull())
+			replyBuffer[0] |= USBASP_STATUS_FULL;
+#if USBASP_WITH_CHECK
+		if (prog_check == PROG_CHECK_RUNNING)
+			replyBuffer[0] |= USBASP_STATUS_CHECK;
+#endif
+		/* a stalled write continues at prog_address */
+		replyBuffer[1] = prog_address;
+		replyBuffer[2] = prog_address >> 8;
+		replyBuffer[3] = prog_address >> 16;
+		replyBuffer[4] = prog_address >> 24;
+		len = 5;
+
+#if USBASP_WITH_STATS
+	} else if (data[1] == USBASP_FUNC_GETSTATS) {
+
+		/* counters as clock_stats_t (little endian), wValue 1 clears */
+		if (data[2] == 1) {
+			memset(&clock_stats, 0, sizeof(clock_stats));
+		} else {
+			usbMsgPtr = (uchar *) &clock_stats;
+			len = sizeof(clock_stats);
+		}
+
+#endif
+#if USBASP_WITH_PAGEHASH
+	} else if (data[1] == USBASP_FUNC_PAGEHASH) {
+
+		/* CRC-16 (as GETCRC) of each flash page of wIndex bytes, 2 bytes
+		   per page. wLength is limited to PROG_CHECK_SIZE */
+		if (!prog_address_newmode)
+			prog_address = (data[3] << 8) | data[2];
+
+		offset = (data[7] << 8) | data[6];
+		if ((offset > PROG_CHECK_SIZE) || (offset < 2) || !(data[4]
+				| data[5])) {
+			/* usbFunctionRead() stalls */
+			prog_state = PROG_STATE_IDLE;
+			return 0xff;
+		}
+		/* the results replace TRANSMITBLOCK data */
+		prog_transferlen = 0;
+		progCheckStart(data, 0, (data[5] << 8) | data[4], offset / 2);
+
+#endif
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+	} else if (data[1] == USBASP_FUNC_STREAM) {
+
+		/* stream nbytes starting at long address on the interrupt IN
+		   endpoint, replaces a running stream. nbytes 0 stops streaming */
+		prog_nbytes = (data[5] << 8) | data[4];
+		progRingStart((data[2] & USBASP_STREAM_EEPROM) ? PROG_STATE_READEEPROM
+				: PROG_STATE_READFLASH, prog_address, prog_nbytes);
+		prog_ringstream = 1;
+		prog_address += prog_nbytes;
+
+#endif
 	} else if (data[1] == USBASP_FUNC_GETCAPABILITIES) {
-		replyBuffer[0] = USBASP_CAP_0_TPI;
-		replyBuffer[1] = 0;
-		replyBuffer[2] = 0;
-		replyBuffer[3] = 0;
-		len = 4;
-	}
 
-	usbMsgPtr = replyBuffer;
+		/* the read ahead ring is idle now and holds the block, V-USB
+		   sends only wLength bytes of it (4 for older hosts) */
+		uchar *caps = (uchar *) prog_ring;
+
+		caps[0] = USBASP_CAP_0_TPI | USBASP_CAP_0_RDYBSY
+				| USBASP_CAP_0_EEPAGE;
+		caps[1] = USBASP_CAP_1_STATUS;
+		caps[2] = 0;
+		caps[3] = 0;
+		caps[4] = USBASP_CAPS_VERSION;
+		caps[5] = USBASP_CAPS_LENGTH;
+		caps[6] = USBASP_ISP_SCK_1500;
+		caps[7] = PROG_RING_SLOTS;
+		caps[8] = PROG_PAGEBUF_SIZE & 0xFF;
+		caps[9] = PROG_PAGEBUF_SIZE >> 8;
+		caps[10] = PROG_TRANSFER_SIZE & 0xFF;
+		caps[11] = PROG_TRANSFER_SIZE >> 8;
+		caps[12] = 254;
+		caps[13] = 0;
+		caps[14] = 0;
+		caps[15] = 0;
+		caps[16] = 0;
+		caps[17] = 0;
+		caps[18] = 0;
+		caps[19] = 0;
+		caps[20] = 0;
+		caps[21] = 0;
+#if USBASP_WITH_CHECK
+		caps[0] |= USBASP_CAP_0_CRC | USBASP_CAP_0_BLANKCHECK;
+#endif
+#if USBASP_WITH_SPARSE
+		caps[0] |= USBASP_CAP_0_SPARSE;
+		caps[18] = PROG_PAGEMAP_SIZE & 0xFF;
+		caps[19] = PROG_PAGEMAP_SIZE >> 8;
+#endif
+#if USBASP_WITH_TRANSMITBLOCK
+		caps[0] |= USBASP_CAP_0_TRANSMITBLOCK;
+#endif
+#if USBASP_WITH_TPI_AUTOCLOCK
+		caps[1] |= USBASP_CAP_1_TPI_AUTOCLOCK;
+#endif
+#if USBASP_WITH_STATS
+		caps[1] |= USBASP_CAP_1_STATS;
+#endif
+#if USBASP_WITH_SCRIPT
+		if (PROG_SCRIPT_SIZE >= PROG_SCRIPT_MIN) {
+			caps[1] |= USBASP_CAP_1_SCRIPT;
+			caps[16] = PROG_SCRIPT_SIZE & 0xFF;
+			caps[17] = PROG_SCRIPT_SIZE >> 8;
+		}
+#endif
+#if USBASP_WITH_RLE
+		caps[1] |= USBASP_CAP_1_RLE;
+#endif
+#if USBASP_WITH_PAGEHASH
+		caps[1] |= USBASP_CAP_1_PAGEHASH;
+		caps[20] = PROG_CHECK_SIZE;
+#endif
+#if USBASP_WITH_SPIFLASH
+		caps[1] |= USBASP_CAP_1_SPIFLASH;
+#endif
+#if USBASP_WITH_CRC32
+		caps[2] |= USBASP_CAP_2_CRC32;
+#endif
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+		caps[1] |= USBASP_CAP_1_STREAM;
+		caps[14] = USB_CFG_INTR_POLL_INTERVAL;
+#endif
+		usbMsgPtr = caps;
+		len = USBASP_CAPS_LENGTH;
+	}
 
 	return len;
 }
 
 uchar usbFunctionRead(uchar *data, uchar len) {
 
+	uchar *slot;
 	uchar i;
 
+	progStatPacket();
+
 	/* check if programmer is in correct read state */
 	if ((prog_state != PROG_STATE_READFLASH) && (prog_state
-			!= PROG_STATE_READEEPROM) && (prog_state != PROG_STATE_TPI_READ)) {
+			!= PROG_STATE_READEEPROM) && (prog_state != PROG_STATE_TPI_READ)
+			&& (prog_state != PROG_STATE_SPIFLASH_READ)) {
 		return 0xff;
 	}
 
+#if USBASP_WITH_SPIFLASH
+	/* SPI flash: one continuous fast read */
+	if (prog_state == PROG_STATE_SPIFLASH_READ) {
+		progStatStart();
+		spiflashRead(prog_address, data, len);
+		progStatSPI();
+		prog_address += len;
+		if (len < 8) {
+			prog_state = PROG_STATE_IDLE;
+		}
+		return len;
+	}
+#endif
+
 	/* fill packet TPI mode */
 	if(prog_state == PROG_STATE_TPI_READ)
 	{
-		tpi_read_block(prog_address, data, len);
+		progStatStart();
+		if (prog_tpinext)
+			tpi_read_next(data, len);
+		else
+			tpi_read_block(prog_address, data, len);
+		progStatSPI();
+		prog_tpinext = 1;
 		prog_address += len;
 		return len;
 	}
 
-	/* fill packet ISP mode */
+	/* fill packet ISP mode, normally read ahead by the main loop */
+	if (prog_ringhead == prog_ringtail) {
+		progRingFill();
+	}
+	slot = prog_ring[prog_ringtail & (PROG_RING_SLOTS - 1)];
 	for (i = 0; i < len; i++) {
-		if (prog_state == PROG_STATE_READFLASH) {
-			data[i] = ispReadFlash(prog_address);
-		} else {
-			data[i] = ispReadEEPROM(prog_address);
-		}
-		prog_address++;
+		data[i] = slot[i];
 	}
+	prog_ringtail++;
+	prog_address += len;
 
 	/* last packet? */
 	if (len < 8) {
@@ -233,69 +1316,318 @@ uchar usbFunctionRead(uchar *data, uchar len) {
 	return len;
 }
 
+/* write one byte of WRITEFLASH/WRITEEEPROM data. the fill buffer must
+   not be full. returns 1 after the last byte */
+static uchar progWriteByte(uchar value) {
+
+	uchar retVal = 0;
+
+#if PROG_PAGEBUF_SIZE
+	if (prog_pagebuffered) {
+		/* collect data in SRAM buffer */
+		if (prog_fillpos == 0) {
+			if (prog_fillmem == PROG_STATE_WRITEFLASH) {
+				progSkipPages();
+			}
+			prog_filladdress = prog_address;
+		}
+		prog_fillbuf[prog_fillpos++] = value;
+		if ((prog_fillpos == prog_pagesize) || (prog_fillpos
+				== PROG_PAGEBUF_SIZE)) {
+			/* page full (or byte mode buffer full with RLE data) */
+			progCommitFill();
+		}
+
+	} else
+#endif
+	if (prog_state == PROG_STATE_WRITEFLASH) {
+		/* Flash */
+
+		if (prog_pagesize == 0) {
+			/* not paged */
+			ispWriteFlash(prog_address, value, 1);
+		} else {
+			/* paged */
+			if (prog_pagecounter == (uchar) prog_pagesize) {
+				progSkipPages();
+			}
+			ispWriteFlash(prog_address, value, 0);
+			prog_pagecounter--;
+			if (prog_pagecounter == 0) {
+				ispFlushPage(prog_address, value);
+				prog_pagecounter = prog_pagesize;
+			}
+		}
+
+	} else if (prog_pagesize == 0) {
+		/* EEPROM */
+		ispWriteEEPROM(prog_address, value);
+
+	} else {
+		/* EEPROM, paged */
+		ispLoadEEPROMPage(prog_address, value);
+		prog_pagecounter--;
+		if (prog_pagecounter == 0) {
+			ispFlushEEPROMPage(prog_address);
+			prog_pagecounter = prog_pagesize;
+		}
+	}
+
+	prog_nbytes--;
+
+	if (prog_nbytes == 0) {
+		if (prog_blockflags & PROG_BLOCKFLAG_LAST) {
+#if PROG_PAGEBUF_SIZE
+			if (prog_pagebuffered) {
+				if ((prog_pagesize != 0) && (prog_fillpos != 0)
+						&& !prog_fillready) {
+					/* last block and page incomplete, so commit it now */
+					progCommitFill();
+				}
+			} else
+#endif
+			if (prog_pagecounter != prog_pagesize) {
+				/* last block and page flush pending, so flush it now */
+				if (prog_state == PROG_STATE_WRITEEEPROM) {
+					ispFlushEEPROMPage(prog_address);
+				} else {
+					ispFlushPage(prog_address, value);
+				}
+			}
+		}
+		prog_state = PROG_STATE_IDLE;
+
+		retVal = 1; // Need to return 1 when no more data is to be received
+	}
+
+	prog_address++;
+
+	return retVal;
+}
+
+#if USBASP_WITH_RLE
+/* write the rest of a repeated byte, stops if the fill buffer gets full.
+   returns 1 after the last expanded byte */
+static uchar progWriteRun() {
+
+	uchar retVal = 0;
+
+	while (prog_rlecount && !retVal && !progFull()) {
+		prog_rlecount--;
+		retVal = progWriteByte(prog_rlevalue);
+	}
+	if (prog_rlecount == 0) {
+		prog_rlestate = PROG_RLE_CONTROL;
+	}
+
+	return retVal;
+}
+
+/* expand one byte of RLE data (see PROG_BLOCKFLAG_RLE) into
+   progWriteByte(). returns 1 after the last expanded byte */
+static uchar progWriteRLE(uchar value) {
+
+	uchar retVal = 0;
+
+	if (prog_rlestate == PROG_RLE_LENGTH_LO) {
+		prog_nbytes = value;
+		prog_rlestate = PROG_RLE_LENGTH_HI;
+
+	} else if (prog_rlestate == PROG_RLE_LENGTH_HI) {
+		prog_nbytes |= (unsigned int) value << 8;
+		prog_rlestate = PROG_RLE_CONTROL;
+
+	} else if (prog_rlestate == PROG_RLE_CONTROL) {
+		if (value & 0x80) {
+			prog_rlecount = (value & 0x7F) + 2;
+			prog_rlestate = PROG_RLE_REPEAT;
+		} else {
+			prog_rlecount = value + 1;
+			prog_rlestate = PROG_RLE_LITERAL;
+		}
+
+	} else if (prog_rlestate == PROG_RLE_LITERAL) {
+		retVal = progWriteByte(value);
+		if (--prog_rlecount == 0) {
+			prog_rlestate = PROG_RLE_CONTROL;
+		}
+
+	} else {
+		prog_rlevalue = value;
+		prog_rlestate = PROG_RLE_RUN;
+		retVal = progWriteRun();
+	}
+
+	return retVal;
+}
+#endif
+
+/* write len bytes of WRITEFLASH/WRITEEEPROM data. bytes left when the
+   fill buffer gets full are kept in prog_spill. returns 1 after the last
+   byte */
+static uchar progWriteData(uchar *data, uchar len) {
+
+	uchar retVal = 0;
+	uchar i;
+
+#if USBASP_WITH_RLE
+	if (prog_rlestate == PROG_RLE_RUN) {
+		retVal = progWriteRun();
+	}
+#endif
+
+	for (i = 0; (i < len) && !retVal; i++) {
+#if PROG_PAGEBUF_SIZE
+		if (prog_fillready) {
+			/* data may be prog_spill itself */
+			memmove(prog_spill, data + i, len - i);
+			prog_spilllen = len - i;
+			return 0;
+		}
+#endif
+#if USBASP_WITH_RLE
+		if (prog_rlestate != PROG_RLE_OFF) {
+			retVal = progWriteRLE(data[i]);
+			continue;
+		}
+#endif
+		retVal = progWriteByte(data[i]);
+	}
+
+#if PROG_PAGEBUF_SIZE
+	prog_spilllen = 0;
+	if (prog_pagebuffered && (prog_pagesize == 0) && (prog_fillpos != 0)
+			&& !prog_fillready) {
+		/* byte mode: commit bytes of this packet */
+		progCommitFill();
+	}
+#endif
+
+	return retVal;
+}
+
 uchar usbFunctionWrite(uchar *data, uchar len) {
 
 	uchar retVal = 0;
+#if USBASP_WITH_TRANSMITBLOCK || USBASP_WITH_SCRIPT || USBASP_WITH_SPARSE
 	uchar i;
+#endif
+
+	progStatPacket();
 
 	/* check if programmer is in correct write state */
 	if ((prog_state != PROG_STATE_WRITEFLASH) && (prog_state
-			!= PROG_STATE_WRITEEEPROM) && (prog_state != PROG_STATE_TPI_WRITE)) {
+			!= PROG_STATE_WRITEEEPROM) && (prog_state != PROG_STATE_TPI_WRITE)
+			&& (prog_state != PROG_STATE_SETPAGEMAP) && (prog_state
+			!= PROG_STATE_TRANSMIT) && (prog_state != PROG_STATE_SCRIPT)
+			&& (prog_state != PROG_STATE_SPIFLASH_WRITE)) {
 		return 0xff;
 	}
 
-	if (prog_state == PROG_STATE_TPI_WRITE)
-	{
-		tpi_write_block(prog_address, data, len);
+#if USBASP_WITH_SPIFLASH
+	if (prog_state == PROG_STATE_SPIFLASH_WRITE) {
+		if (len > prog_nbytes)
+			len = prog_nbytes;
+		progStatStart();
+		spiflashWrite(prog_address, data, len);
+		progStatSPI();
 		prog_address += len;
 		prog_nbytes -= len;
-		if(prog_nbytes <= 0)
-		{
+		if (prog_nbytes == 0) {
 			prog_state = PROG_STATE_IDLE;
 			return 1;
 		}
 		return 0;
 	}
+#endif
 
-	for (i = 0; i < len; i++) {
-
-		if (prog_state == PROG_STATE_WRITEFLASH) {
-			/* Flash */
-
-			if (prog_pagesize == 0) {
-				/* not paged */
-				ispWriteFlash(prog_address, data[i], 1);
-			} else {
-				/* paged */
-				ispWriteFlash(prog_address, data[i], 0);
-				prog_pagecounter--;
-				if (prog_pagecounter == 0) {
-					ispFlushPage(prog_address, data[i]);
-					prog_pagecounter = prog_pagesize;
-				}
-			}
-
-		} else {
-			/* EEPROM */
-			ispWriteEEPROM(prog_address, data[i]);
+#if USBASP_WITH_TRANSMITBLOCK
+	if (prog_state == PROG_STATE_TRANSMIT) {
+		progStatStart();
+		for (i = 0; (i < len) && (prog_transferlen < prog_nbytes); i++) {
+			prog_transferbuf[prog_transferlen++] = ispTransmit(data[i]);
 		}
+		progStatSPI();
+		if (prog_transferlen == prog_nbytes) {
+			prog_state = PROG_STATE_IDLE;
+			return 1;
+		}
+		return 0;
+	}
+#endif
 
-		prog_nbytes--;
-
-		if (prog_nbytes == 0) {
+#if USBASP_WITH_SCRIPT
+	if (prog_state == PROG_STATE_SCRIPT) {
+		for (i = 0; (i < len) && (prog_transferlen < prog_nbytes); i++) {
+			prog_transferbuf[prog_transferlen++] = data[i];
+		}
+		if (prog_transferlen == prog_nbytes) {
+			/* the status stage is delayed until the script is done */
 			prog_state = PROG_STATE_IDLE;
-			if ((prog_blockflags & PROG_BLOCKFLAG_LAST) && (prog_pagecounter
-					!= prog_pagesize)) {
+			progRunScript(prog_nbytes);
+			return 1;
+		}
+		return 0;
+	}
+#endif
 
-				/* last block and page flush pending, so flush it now */
-				ispFlushPage(prog_address, data[i]);
-			}
+#if USBASP_WITH_SPARSE
+	if (prog_state == PROG_STATE_SETPAGEMAP) {
+		for (i = 0; (i < len) && (prog_pagemap_len < prog_nbytes); i++) {
+			prog_pagemap[prog_pagemap_len++] = data[i];
+		}
+		if (prog_pagemap_len == prog_nbytes) {
+			prog_state = PROG_STATE_IDLE;
+			return 1;
+		}
+		return 0;
+	}
+#endif
 
-			retVal = 1; // Need to return 1 when no more data is to be received
+	if (prog_state == PROG_STATE_TPI_WRITE)
+	{
+		progStatStart();
+		if (prog_tpinext)
+			tpi_write_next(prog_address, data, len);
+		else
+			tpi_write_block(prog_address, data, len);
+		progStatSPI();
+		prog_tpinext = 1;
+		prog_address += len;
+		prog_nbytes -= len;
+		if(prog_nbytes <= 0)
+		{
+			prog_state = PROG_STATE_IDLE;
+			return 1;
 		}
+		return 0;
+	}
 
-		prog_address++;
+#if PROG_PAGEBUF_SIZE
+	if (prog_fillready) {
+		/* the fill hold timed out (slow SCK). the host waits until
+		   GETSTATUS reports the buffer not full and continues at the
+		   address reported */
+		prog_state = PROG_STATE_IDLE;
+		return 0xff;
+	}
+#endif
+
+	retVal = progWriteData(data, len);
+
+#if PROG_PAGEBUF_SIZE
+	if (prog_pagebuffered) {
+		prog_outbytes -= (len < prog_outbytes) ? len : prog_outbytes;
+		if (retVal) {
+			progHold();
+		} else if (prog_fillready) {
+			progHoldFill();
+			/* last packet kept in prog_spill, progPoll() ends the write */
+			if (prog_outbytes == 0)
+				retVal = 1;
+		}
 	}
+#endif
 
 	return retVal;
 }
@@ -314,6 +1646,10 @@ int main(void) {
 	sei();
 	for (;;) {
 		usbPoll();
+		progPoll();
+		progCheckStep();
+		progRingFill();
+		progStream();
 	}
 	return 0;
 }
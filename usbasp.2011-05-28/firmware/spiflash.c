@@ -0,0 +1,182 @@
+/*
+ * spiflash.c - part of USBasp
+ *
+ * Description....: Programming of serial (25 series) NOR flash connected
+ *                  to the ISP connector, RST is used as chip select
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#include <avr/io.h>
+#include "isp.h"
+#include "clock.h"
+#include "spiflash.h"
+#include "usbasp.h"
+
+#if USBASP_WITH_SPIFLASH
+
+#define spiflashSelect()   ISP_OUT &= ~(1 << ISP_RST)
+#define spiflashDeselect() ISP_OUT |= (1 << ISP_RST)
+
+static uchar spiflash_mode = SPIFLASH_IDLE;
+static unsigned long spiflash_address;
+
+void spiflashConnect() {
+
+	/* CS high, SCK low */
+	ISP_OUT |= (1 << ISP_RST);
+	ISP_OUT &= ~(1 << ISP_SCK);
+	ISP_DDR |= (1 << ISP_RST) | (1 << ISP_SCK) | (1 << ISP_MOSI);
+
+	if (ispTransmit == ispTransmit_hw) {
+		spiHWenable();
+	}
+
+	spiflash_mode = SPIFLASH_IDLE;
+}
+
+static void spiflashAddress(uchar cmd, unsigned long address) {
+
+	ispTransmit(cmd);
+	ispTransmit(address >> 16);
+	ispTransmit(address >> 8);
+	ispTransmit(address);
+}
+
+static void spiflashWriteEnable() {
+
+	spiflashSelect();
+	ispTransmit(SPIFLASH_CMD_WREN);
+	spiflashDeselect();
+}
+
+uchar spiflashReadStatus() {
+
+	uchar status;
+
+	spiflashSelect();
+	ispTransmit(SPIFLASH_CMD_RDSR);
+	status = ispTransmit(0);
+	spiflashDeselect();
+
+	return status;
+}
+
+/* wait for WIP to clear, at most time * 320 us */
+static void spiflashWait(uchar time) {
+
+	uint8_t starttime = TIMERVALUE;
+
+	while (spiflashReadStatus() & SPIFLASH_SR_WIP) {
+		if ((uint8_t) (TIMERVALUE - starttime) >= CLOCK_T_320us) {
+			starttime += CLOCK_T_320us;
+			if (--time == 0) {
+				return;
+			}
+		}
+	}
+}
+
+void spiflashEnd() {
+
+	if (spiflash_mode == SPIFLASH_IDLE) {
+		return;
+	}
+
+	spiflashDeselect();
+
+	if (spiflash_mode == SPIFLASH_PROGRAM) {
+		/* page program takes up to 5 ms */
+		spiflashWait(32);
+	}
+
+	spiflash_mode = SPIFLASH_IDLE;
+}
+
+void spiflashReadID(uchar *id) {
+
+	spiflashEnd();
+
+	spiflashSelect();
+	ispTransmit(SPIFLASH_CMD_RDID);
+	id[0] = ispTransmit(0);
+	id[1] = ispTransmit(0);
+	id[2] = ispTransmit(0);
+	spiflashDeselect();
+}
+
+void spiflashErase(uchar cmd, unsigned long address) {
+
+	spiflashEnd();
+	spiflashWriteEnable();
+
+	spiflashSelect();
+	if (cmd == SPIFLASH_CMD_CE) {
+		ispTransmit(cmd);
+	} else {
+		spiflashAddress(cmd, address);
+	}
+	spiflashDeselect();
+}
+
+void spiflashRead(unsigned long address, uchar *data, uchar len) {
+
+	uchar i;
+
+	if ((spiflash_mode != SPIFLASH_READ) || (spiflash_address != address)) {
+		spiflashEnd();
+		spiflashSelect();
+		spiflashAddress(SPIFLASH_CMD_FAST_READ, address);
+		ispTransmit(0); /* dummy byte */
+		spiflash_mode = SPIFLASH_READ;
+		spiflash_address = address;
+	}
+
+	if ((ispTransmit == ispTransmit_hw) && len) {
+		/* next byte is started as soon as the last one is complete */
+		SPDR = 0;
+		for (i = 0; i < len - 1; i++) {
+			while (!(SPSR & (1 << SPIF)))
+				;
+			data[i] = SPDR;
+			SPDR = 0;
+		}
+		while (!(SPSR & (1 << SPIF)))
+			;
+		data[i] = SPDR;
+	} else {
+		for (i = 0; i < len; i++) {
+			data[i] = ispTransmit(0);
+		}
+	}
+
+	spiflash_address += len;
+}
+
+void spiflashWrite(unsigned long address, uchar *data, uchar len) {
+
+	while (len--) {
+
+		if ((spiflash_mode != SPIFLASH_PROGRAM) || (spiflash_address
+				!= address)) {
+			spiflashEnd();
+			spiflashWriteEnable();
+			spiflashSelect();
+			spiflashAddress(SPIFLASH_CMD_PP, address);
+			spiflash_mode = SPIFLASH_PROGRAM;
+			spiflash_address = address;
+		}
+
+		ispTransmit(*data++);
+		address++;
+		spiflash_address++;
+
+		if ((address & (SPIFLASH_PAGESIZE - 1)) == 0) {
+			/* page full, program it */
+			spiflashEnd();
+		}
+	}
+}
+
+#endif /* USBASP_WITH_SPIFLASH */
@@ -0,0 +1,62 @@
+/*
+ * spiflash.h - part of USBasp
+ *
+ * Description....: Programming of serial (25 series) NOR flash connected
+ *                  to the ISP connector, RST is used as chip select
+ * Licence........: GNU GPL v2 (see Readme.txt)
+ * Creation Date..: 2026-10-17
+ * Last change....: 2026-10-17
+ */
+
+#ifndef __spiflash_h_included__
+#define	__spiflash_h_included__
+
+#ifndef uchar
+#define	uchar	unsigned char
+#endif
+
+/* SPI flash instructions */
+#define SPIFLASH_CMD_WREN       0x06  /* write enable */
+#define SPIFLASH_CMD_RDSR       0x05  /* read status register */
+#define SPIFLASH_CMD_RDID       0x9F  /* JEDEC ID */
+#define SPIFLASH_CMD_FAST_READ  0x0B
+#define SPIFLASH_CMD_PP         0x02  /* page program */
+#define SPIFLASH_CMD_SE         0x20  /* 4 KB sector erase */
+#define SPIFLASH_CMD_BE         0xD8  /* 64 KB block erase */
+#define SPIFLASH_CMD_CE         0xC7  /* chip erase */
+
+/* status register bits */
+#define SPIFLASH_SR_WIP         0x01  /* write in progress */
+
+/* page program size */
+#define SPIFLASH_PAGESIZE       256
+
+/* running operation */
+#define SPIFLASH_IDLE           0
+#define SPIFLASH_READ           1
+#define SPIFLASH_PROGRAM        2
+
+/* set up ISP pins for SPI flash with the current SCK option */
+void spiflashConnect();
+
+/* end a running read or page program (wait for the program to finish) */
+void spiflashEnd();
+
+/* read 3 byte JEDEC ID */
+void spiflashReadID(uchar *id);
+
+/* read status register */
+uchar spiflashReadStatus();
+
+/* start erase with SPIFLASH_CMD_SE/BE/CE, doesn't wait for completion */
+void spiflashErase(uchar cmd, unsigned long address);
+
+/* read len bytes. a read continuing the last one goes on without a new
+   instruction, so consecutive calls stream the flash */
+void spiflashRead(unsigned long address, uchar *data, uchar len);
+
+/* program len bytes. a page program stays open until the page is full,
+   the data doesn't continue at address or spiflashEnd() is called */
+void spiflashWrite(unsigned long address, uchar *data, uchar len);
+
+#endif /* __spiflash_h_included__ */
@@ -32,16 +32,29 @@ uint8_t tpi_recv_byte(void);
  * Read block
  * \param addr Address of block
  * \param dptr Pointer to dest memory block
- * \param len Length of read
+ * \param len Length of read (1..65535)
  */
-void tpi_read_block(uint16_t addr, uint8_t* dptr, uint8_t len);
+void tpi_read_block(uint16_t addr, uint8_t* dptr, uint16_t len);
+/**
+ * Read block following the last read (PR is not sent again)
+ * \param dptr Pointer to dest memory block
+ * \param len Length of read (1..65535)
+ */
+void tpi_read_next(uint8_t* dptr, uint16_t len);
 /**
  * Write block
  * \param addr Address to program
  * \param sptr Pointer to source block
- * \param len Length of write
+ * \param len Length of write (1..65535)
+ */
+void tpi_write_block(uint16_t addr, const uint8_t* sptr, uint16_t len);
+/**
+ * Write block following the last write (PR and NVMCMD are not sent again)
+ * \param addr Address to program, must match PR
+ * \param sptr Pointer to source block
+ * \param len Length of write (1..65535)
  */
-void tpi_write_block(uint16_t addr, const uint8_t* sptr, uint8_t len);
+void tpi_write_next(uint16_t addr, const uint8_t* sptr, uint16_t len);
 
 
 #endif /*__TPI_H__*/
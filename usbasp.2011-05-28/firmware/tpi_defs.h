@@ -36,6 +36,9 @@
 #define TPIPCR_GT_2b   0x06
 #define TPIPCR_GT_0b   0x07
 
+// TPIIR value
+#define TPIIR_ID       0x80
+
 // TPISR bits
 #define TPISR_NVMEN    0x02
 
@@ -26,12 +26,117 @@
 #define USBASP_FUNC_TPI_DISCONNECT   12
 #define USBASP_FUNC_TPI_RAWREAD      13
 #define USBASP_FUNC_TPI_RAWWRITE     14
+/* TPI_READBLOCK reads up to 254 bytes (max. IN transfer, the low byte of
+   wLength: 255 is USB_NO_MSG, 256 returns nothing). TPI_WRITEBLOCK takes
+   the full 16 bit wLength */
 #define USBASP_FUNC_TPI_READBLOCK    15
 #define USBASP_FUNC_TPI_WRITEBLOCK   16
+#define USBASP_FUNC_SETPOLLMODE      17
+#define USBASP_FUNC_GETCRC           18
+#define USBASP_FUNC_BLANKCHECK       19
+#define USBASP_FUNC_SETPAGEMAP       20
+#define USBASP_FUNC_TRANSMITBLOCK    21
+#define USBASP_FUNC_SCRIPT           22
+#define USBASP_FUNC_STREAM           23
+#define USBASP_FUNC_PAGEHASH         24
+#define USBASP_FUNC_SPIFLASH_CONNECT 25
+#define USBASP_FUNC_SPIFLASH_ID      26
+#define USBASP_FUNC_SPIFLASH_READ    27
+#define USBASP_FUNC_SPIFLASH_WRITE   28
+#define USBASP_FUNC_SPIFLASH_ERASE   29
+#define USBASP_FUNC_SPIFLASH_STATUS  30
+#define USBASP_FUNC_GETSTATS         31
+#define USBASP_FUNC_GETSTATUS        32
 #define USBASP_FUNC_GETCAPABILITIES 127
 
 /* USBASP capabilities */
 #define USBASP_CAP_0_TPI    0x01
+#define USBASP_CAP_0_RDYBSY 0x02
+#define USBASP_CAP_0_EEPAGE 0x04
+#define USBASP_CAP_0_CRC    0x08
+#define USBASP_CAP_0_BLANKCHECK 0x10
+#define USBASP_CAP_0_SPARSE 0x20
+#define USBASP_CAP_0_TRANSMITBLOCK 0x40
+#define USBASP_CAP_1_SCRIPT 0x01
+#define USBASP_CAP_1_STREAM 0x02
+#define USBASP_CAP_1_TPI_AUTOCLOCK 0x04
+#define USBASP_CAP_1_RLE    0x08
+#define USBASP_CAP_1_PAGEHASH 0x10
+#define USBASP_CAP_1_SPIFLASH 0x20
+#define USBASP_CAP_1_STATS  0x40
+#define USBASP_CAP_1_STATUS 0x80
+#define USBASP_CAP_2_CRC32  0x01
+
+/* extended capabilities, returned by GETCAPABILITIES if wLength allows.
+   bytes 0..3 are the capability flags above, then:
+   4: block version, 5: block length, 6: fastest ISP SCK option,
+   7: read ahead packets, 8/9: SRAM page buffer size,
+   10/11: TRANSMITBLOCK buffer size, 12/13: max. IN transfer,
+   14: STREAM endpoint poll interval in ms (0: no STREAM), 15: reserved.
+   version 2: 16/17: max. SCRIPT length (0: no SCRIPT).
+   version 3: 18/19: max. SETPAGEMAP length in bytes, longer maps are
+   stalled. 20/21: max. PAGEHASH wLength (0: no PAGEHASH).
+   later versions only append fields */
+#define USBASP_CAPS_VERSION     3
+#define USBASP_CAPS_LENGTH      22
+
+/* write completion detection */
+#define USBASP_POLL_DATA      0   /* data polling / fixed delays (default) */
+#define USBASP_POLL_RDYBSY    1   /* "Poll RDY/BSY" instruction */
+
+/* GETCRC options. CRC-16 is CCITT reflected (0x8408) with init 0xFFFF,
+   no final xor. CRC-32 is IEEE 802.3 (as used by zlib). the range length
+   is passed in wIndex, options in the wValue high byte (long address
+   only, else wValue is the address and options are 0) */
+#define USBASP_CRC_EEPROM     0x01  /* checksum EEPROM instead of flash */
+#define USBASP_CRC_32         0x02  /* CRC-32 instead of CRC-16 */
+
+/* BLANKCHECK status, followed by first non blank (or end) address. the
+   range length is passed in wIndex.
+   GETCRC, BLANKCHECK and PAGEHASH run in the background: the request
+   starts the check and returns no data. the host polls GETSTATUS while
+   USBASP_STATUS_CHECK is set, then repeats the request (same setup data
+   and address) to get the result. other requests using the target cancel
+   the check */
+#define USBASP_BLANK          0
+#define USBASP_NOT_BLANK      1
+
+/* SCRIPT ops. SPI instructions are 4 bytes, "last" is the 4th byte read
+   back by the latest SPI op. the result block starts with a status byte
+   followed by the bytes stored by SPI_READ */
+#define USBASP_SCRIPT_END        0x00  /* end of script */
+#define USBASP_SCRIPT_SPI        0x01  /* b0 b1 b2 b3: SPI instruction */
+#define USBASP_SCRIPT_SPI_READ   0x02  /* b0 b1 b2 b3: same, store last */
+#define USBASP_SCRIPT_WAIT       0x03  /* t: wait t * 320 us */
+#define USBASP_SCRIPT_WAIT_READY 0x04  /* t: poll RDY/BSY, timeout t * 320 us */
+#define USBASP_SCRIPT_ENTERPROG  0x05  /* enter programming mode */
+#define USBASP_SCRIPT_RETRY      0x06  /* mask value count back: jump back
+                                          back bytes while (last & mask)
+                                          != value, at most count times */
+
+/* SCRIPT result status */
+#define USBASP_SCRIPT_OK         0
+#define USBASP_SCRIPT_FAILED     1   /* timeout, retries or prog mode failed */
+#define USBASP_SCRIPT_INVALID    2   /* unknown op or truncated script */
+
+/* STREAM options. STREAM is built only with USB_CFG_HAVE_INTRIN_ENDPOINT
+   (off by default, see usbconfig.h) */
+#define USBASP_STREAM_EEPROM     0x01  /* stream EEPROM instead of flash */
+
+/* GETSTATUS flags, followed by the long address (4 bytes, little endian)
+   written data continues at. after the last write block the next request
+   is NAKed until the target is written, for at most 2 s. later requests
+   using the target are stalled while USBASP_STATUS_BUSY is set. data of
+   a write request is NAKed the same way while the page buffers are full,
+   after 2 s it is stalled: the host polls until USBASP_STATUS_FULL is
+   cleared and writes the rest starting at the address reported */
+#define USBASP_STATUS_BUSY       0x01  /* written data still goes to target */
+#define USBASP_STATUS_FULL       0x02  /* page buffers full, writes stalled */
+#define USBASP_STATUS_CHECK      0x04  /* GETCRC, BLANKCHECK or PAGEHASH runs */
+
+/* TPI_CONNECT options (wIndex low byte) */
+#define USBASP_TPI_AUTOCLOCK     0x01  /* search fastest clock, wValue is
+                                          the slowest delay to try */
 
 /* programming state */
 #define PROG_STATE_IDLE         0
@@ -41,10 +146,119 @@
 #define PROG_STATE_WRITEEEPROM  4
 #define PROG_STATE_TPI_READ     5
 #define PROG_STATE_TPI_WRITE    6
+#define PROG_STATE_SETPAGEMAP   7
+#define PROG_STATE_TRANSMIT     8
+#define PROG_STATE_SCRIPT       9
+#define PROG_STATE_SPIFLASH_READ  10
+#define PROG_STATE_SPIFLASH_WRITE 11
 
 /* Block mode flags */
 #define PROG_BLOCKFLAG_FIRST    1
 #define PROG_BLOCKFLAG_LAST     2
+#define PROG_BLOCKFLAG_PAGED    4   /* WRITEEEPROM: use EEPROM page instructions */
+#define PROG_BLOCKFLAG_RLE      8   /* data is run length encoded */
+
+/* RLE data: 2 bytes (little endian) expanded length, then runs. control
+   byte c < 0x80 is followed by c + 1 literal bytes, c >= 0x80 by one byte
+   repeated (c & 0x7F) + 2 times. decoder states: */
+#define PROG_RLE_OFF            0
+#define PROG_RLE_LENGTH_LO      1
+#define PROG_RLE_LENGTH_HI      2
+#define PROG_RLE_CONTROL        3
+#define PROG_RLE_LITERAL        4
+#define PROG_RLE_REPEAT         5
+#define PROG_RLE_RUN            6   /* writing the repeated byte */
+
+/* max. size of sparse programming page map in bytes (8 pages per byte) */
+#define PROG_PAGEMAP_SIZE       64
+
+/* number of 8 byte packets read ahead, power of 2. at least 4, the ring
+   holds the GETCAPABILITIES block */
+#define PROG_RING_SLOTS         4
+
+/* NAK hold after a write request, ends after PROG_HOLD_TICKS (2 s) */
+#define PROG_HOLD_OFF           0
+#define PROG_HOLD_FILL          1   /* until the fill buffer is committed */
+#define PROG_HOLD_IDLE          2   /* until the target is written */
+#define PROG_HOLD_TICKS         (F_CPU / 64 * 2)
+
+/* GETCRC, BLANKCHECK and PAGEHASH state */
+#define PROG_CHECK_IDLE         0
+#define PROG_CHECK_RUNNING      1
+#define PROG_CHECK_DONE         2
+
+/* page commit state */
+#define PROG_COMMIT_IDLE        0
+#define PROG_COMMIT_LOAD        1
+#define PROG_COMMIT_FLUSH       2
+
+/* core extensions, built in unless the programmer has less than 8 KB
+   flash (ATmega48). define one to 0 to leave it out, e.g. make main.hex
+   TARGET=atmega8 DEFINES=-DUSBASP_WITH_STATS=0 */
+#if defined(FLASHEND) && (FLASHEND <= 0xFFF)
+#define USBASP_CORE             0
+#else
+#define USBASP_CORE             1
+#endif
+#ifndef USBASP_WITH_CHECK
+#define USBASP_WITH_CHECK       USBASP_CORE   /* GETCRC, BLANKCHECK */
+#endif
+#ifndef USBASP_WITH_SPARSE
+#define USBASP_WITH_SPARSE      USBASP_CORE   /* SETPAGEMAP */
+#endif
+#ifndef USBASP_WITH_TRANSMITBLOCK
+#define USBASP_WITH_TRANSMITBLOCK USBASP_CORE
+#endif
+#ifndef USBASP_WITH_STATS
+#define USBASP_WITH_STATS       USBASP_CORE   /* GETSTATS */
+#endif
+#ifndef USBASP_WITH_SCKCACHE
+#define USBASP_WITH_SCKCACHE    USBASP_CORE   /* EEPROM_SCK_CACHE */
+#endif
+#ifndef USBASP_WITH_TPI_AUTOCLOCK
+#define USBASP_WITH_TPI_AUTOCLOCK USBASP_CORE
+#endif
+
+/* optional engines, left out by default to fit the ATmega8. define to 1
+   to build them in (e.g. make main.hex DEFINES=-DUSBASP_WITH_SCRIPT=1).
+   STREAM needs USB_CFG_HAVE_INTRIN_ENDPOINT, see usbconfig.h */
+#ifndef USBASP_WITH_SCRIPT
+#define USBASP_WITH_SCRIPT      0
+#endif
+#ifndef USBASP_WITH_CRC32
+#define USBASP_WITH_CRC32       0   /* GETCRC option USBASP_CRC_32 */
+#endif
+#ifndef USBASP_WITH_SPIFLASH
+#define USBASP_WITH_SPIFLASH    0
+#endif
+#ifndef USBASP_WITH_RLE
+#define USBASP_WITH_RLE         0   /* PROG_BLOCKFLAG_RLE */
+#endif
+#ifndef USBASP_WITH_PAGEHASH
+#define USBASP_WITH_PAGEHASH    0
+#endif
+#if (USBASP_WITH_CRC32 || USBASP_WITH_PAGEHASH) && !USBASP_WITH_CHECK
+#error "USBASP_WITH_CRC32 and USBASP_WITH_PAGEHASH need USBASP_WITH_CHECK"
+#endif
+
+/* size of each of the two SRAM page buffers used for flash programming.
+   larger pages are written directly to the target. with 256 about 810 of
+   the 1024 bytes SRAM of the ATmega8/88 are static data */
+#ifndef PROG_PAGEBUF_SIZE
+#if RAMEND >= 0x45F
+#define PROG_PAGEBUF_SIZE       256
+#else
+#define PROG_PAGEBUF_SIZE       0
+#endif
+#endif
+
+/* programmer EEPROM: SCK options of recently seen targets (entries of
+   3 signature bytes and the option), next entry to replace and the last
+   working TPI delay (TPI targets can't be identified before NVM access) */
+#define EEPROM_SCK_CACHE        0x10
+#define EEPROM_SCK_CACHE_SIZE   8
+#define EEPROM_SCK_CACHE_NEXT   0x30
+#define EEPROM_TPI_DELAY        0x31
 
 /* ISP SCK speed identifiers */
 #define USBASP_ISP_SCK_AUTO   0
@@ -60,6 +274,9 @@
 #define USBASP_ISP_SCK_375    10  /* 375 kHz   */
 #define USBASP_ISP_SCK_750    11  /* 750 kHz   */
 #define USBASP_ISP_SCK_1500   12  /* 1.5 MHz   */
+#define USBASP_ISP_SCK_50     13  /*  50 kHz */
+#define USBASP_ISP_SCK_64     14  /*  64 kHz */
+#define USBASP_ISP_SCK_80     15  /*  80 kHz */
 
 /* macros for gpio functions */
 #define ledRedOn()    PORTC &= ~(1 << PC2)
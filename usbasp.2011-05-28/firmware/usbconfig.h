@@ -59,9 +59,14 @@ the newest features and options.
 
 /* --------------------------- Functional Range ---------------------------- */
 
+#ifndef USB_CFG_HAVE_INTRIN_ENDPOINT
 #define USB_CFG_HAVE_INTRIN_ENDPOINT    0
+#endif
 /* Define this to 1 if you want to compile a version with two endpoints: The
  * default control endpoint 0 and an interrupt-in endpoint 1.
+ * USBasp: endpoint 1 carries STREAM reads. It is off by default, READFLASH
+ * with read ahead is faster. Build with -DUSB_CFG_HAVE_INTRIN_ENDPOINT=1
+ * to enable it.
  */
 #define USB_CFG_HAVE_INTRIN_ENDPOINT3   0
 /* Define this to 1 if you want to compile a version with three endpoints: The
@@ -104,7 +109,7 @@ the newest features and options.
  * You must implement the function usbFunctionWriteOut() which receives all
  * interrupt/bulk data sent to endpoint 1.
  */
-#define USB_CFG_HAVE_FLOWCONTROL        0
+#define USB_CFG_HAVE_FLOWCONTROL        1
 /* Define this to 1 if you want flowcontrol over USB data. See the definition
  * of the macros usbDisableAllRequests() and usbEnableAllRequests() in
  * usbdrv.h.